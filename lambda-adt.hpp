@@ -0,0 +1,582 @@
+/**
+ * @file lambda-adt.hpp
+ * @brief C++ のデータ型とスコットエンコーディングによるラムダ式とを相互に変換します。
+ */
+
+#pragma once
+
+#include "lambda-expression.hpp"
+#include <any>
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace lambda {
+    namespace native {
+        struct constructor;
+        struct choice;
+        struct collector;
+    }
+
+    template <>
+    struct profile::is_native<native::constructor> : std::true_type {
+    };
+    template <>
+    struct profile::is_native<native::choice> : std::true_type {
+    };
+    template <>
+    struct profile::is_native<native::collector> : std::true_type {
+    };
+
+    namespace native {
+        /**
+         * @brief スコットエンコーディングによる代数的データ型の値
+         * @detail count 個あるコンストラクタのうち index 番目で作られた値で、フィールドを fields に持つ。
+         * count 個の場合分けの関数を順に受け取り、index 番目の関数にフィールドを順に適用する。
+         * fields は const でない std::vector として確保すること。解放するときに中身を移し出す。
+         */
+        struct constructor {
+            std::size_t index;
+            std::size_t count;
+            std::shared_ptr<const std::vector<expression>> fields;
+
+            std::size_t arity() const
+            {
+                return fields ? fields->size() : 0;
+            }
+
+            expression operator()(expression f) const;
+
+            /**
+             * 深い木を再帰的に解放してスタックを溢れさせないよう、
+             * ほかから参照されていないフィールドは手元の一覧に移してから一つずつ解放する。
+             */
+            ~constructor()
+            {
+                std::vector<expression> pending;
+                unlink(fields, pending);
+                while (!pending.empty()) {
+                    expression x = std::move(pending.back());
+                    pending.pop_back();
+                    if (auto c = x.target<constructor>()) {
+                        unlink(c->fields, pending);
+                    } else if (auto t = x.target<expression::thunk>()) {
+                        t->release(pending);
+                    }
+                }
+            }
+
+        private:
+            /** 参照されていないフィールドの配列から要素を pending に移す。配列そのものは const でないので書き換えてよい */
+            static void unlink(std::shared_ptr<const std::vector<expression>> &fields, std::vector<expression> &pending)
+            {
+                if (fields && fields.use_count() == 1) {
+                    auto &items = const_cast<std::vector<expression> &>(*fields);
+                    std::move(items.begin(), items.end(), std::back_inserter(pending));
+                    fields.reset();
+                }
+            }
+        };
+
+        /** 場合分けの関数をまだ受け取っている途中の constructor */
+        struct choice {
+            std::size_t index;
+            std::size_t received;
+            std::size_t count;
+            expression handler;
+            std::shared_ptr<const std::vector<expression>> fields;
+
+            expression operator()(expression f) const
+            {
+                choice next{index, received + 1, count, received == index ? f : handler, fields};
+                if (next.received < count) {
+                    return next;
+                }
+                expression result = next.handler;
+                if (fields) {
+                    for (const auto &x : *fields) {
+                        result = tail_call(result, x);
+                    }
+                }
+                return result;
+            }
+        };
+
+        inline expression constructor::operator()(expression f) const
+        {
+            return choice{index, 0, count, expression(), fields}(f);
+        }
+
+        /** 場合分けの関数として渡され、受け取ったフィールドを constructor にまとめ直す */
+        struct collector {
+            std::size_t index;
+            std::size_t count;
+            std::size_t arity;
+            std::shared_ptr<const std::vector<expression>> fields;
+
+            expression operator()(expression x) const
+            {
+                auto collected = fields ? std::make_shared<std::vector<expression>>(*fields) : std::make_shared<std::vector<expression>>();
+                collected->push_back(x);
+                if (collected->size() == arity) {
+                    return constructor{index, count, collected};
+                }
+                return collector{index, count, arity, collected};
+            }
+        };
+    }
+
+    namespace adt {
+        struct shape;
+
+        /** 形を返す関数。再帰的な型を表せるよう、形どうしはこれを通して参照する */
+        using shape_ref = const shape &(*)();
+
+        /**
+         * @brief デコードのための型の形
+         * @detail 型ごとに一つだけ作られ、adt_decode はこれを見ながら反復的にデコードする。
+         */
+        struct shape {
+            enum class kind {
+                leaf,         /**< ラムダ式から直接値を取り出す */
+                constructors, /**< コンストラクタごとにフィールドを持つ */
+                list,         /**< 同じ形の要素を並べたスコットリスト */
+                wrapper       /**< 別の形の値から組み立てる */
+            } form;
+
+            /** leaf: ラムダ式から値を取り出す */
+            std::any (*leaf)(const expression &);
+
+            /** constructors: 各コンストラクタのフィールドの形 */
+            std::vector<std::vector<shape_ref>> constructors;
+
+            /** list, wrapper: 要素または中身の形 */
+            shape_ref inner;
+
+            /** constructors, list, wrapper: index 番目のコンストラクタとして、デコード済みの子 n 個から値を組み立てる */
+            std::any (*build)(std::size_t index, std::any *children, std::size_t n);
+        };
+
+        /**
+         * @brief 利用者定義の型を既知の型に対応付ける
+         * @detail 特殊化して type, represent, restore を定義すると adt_encode と adt_decode で扱えるようになる。
+         * @code
+         * template <>
+         * struct lambda::adt::representation<point> {
+         *     using type = std::tuple<unsigned, unsigned>;
+         *     static type represent(const point &p) { return {p.x, p.y}; }
+         *     static point restore(type &&t) { return {std::get<0>(t), std::get<1>(t)}; }
+         * };
+         * @endcode
+         */
+        template <class T>
+        struct representation;
+
+        /**
+         * @brief 型ごとのエンコード方法と形
+         * @detail encode と form を持つ。
+         */
+        template <class T, class = void>
+        struct traits {
+            using type = typename representation<T>::type;
+
+            static expression encode(const T &x)
+            {
+                return traits<type>::encode(representation<T>::represent(x));
+            }
+
+            static const shape &form()
+            {
+                static const shape s{
+                    shape::kind::wrapper, nullptr, {}, &traits<type>::form,
+                    [](std::size_t, std::any *children, std::size_t) {
+                        return std::any(representation<T>::restore(std::any_cast<type>(std::move(children[0]))));
+                    }};
+                return s;
+            }
+        };
+
+        /** ラムダ式はそのまま */
+        template <>
+        struct traits<expression> {
+            static expression encode(const expression &x)
+            {
+                return x;
+            }
+
+            static const shape &form()
+            {
+                static const shape s{
+                    shape::kind::leaf, [](const expression &e) { return std::any(e); }, {}, nullptr, nullptr};
+                return s;
+            }
+        };
+
+        /** 真偽値はチャーチブール値 */
+        template <>
+        struct traits<bool> {
+            static expression encode(bool x)
+            {
+                return x ? combinators::truth : combinators::falsity;
+            }
+
+            static const shape &form()
+            {
+                static const shape s{
+                    shape::kind::leaf, [](const expression &e) { return std::any(native::decide(e)); }, {}, nullptr, nullptr};
+                return s;
+            }
+        };
+
+        /** 符号なし整数はチャーチ数 */
+        template <class T>
+        struct traits<T, std::enable_if_t<std::is_integral_v<T> && std::is_unsigned_v<T> && !std::is_same_v<T, bool>>> {
+            static expression encode(T x)
+            {
+                return church_encode(x);
+            }
+
+            static const shape &form()
+            {
+                static const shape s{
+                    shape::kind::leaf, [](const expression &e) { return std::any(static_cast<T>(church_decode(e))); }, {}, nullptr, nullptr};
+                return s;
+            }
+        };
+
+        /**
+         * @brief コンストラクタ一つ分のフィールド
+         * @detail タプルとペアは要素ごと、std::monostate はフィールドなし、それ以外は値そのものを一つのフィールドとする。
+         */
+        template <class T>
+        struct members {
+            static std::vector<shape_ref> forms()
+            {
+                return {&traits<T>::form};
+            }
+
+            static void encode(const T &x, std::vector<expression> &fields)
+            {
+                fields.push_back(traits<T>::encode(x));
+            }
+
+            static T build(std::any *children)
+            {
+                return std::any_cast<T>(std::move(children[0]));
+            }
+        };
+
+        template <>
+        struct members<std::monostate> {
+            static std::vector<shape_ref> forms()
+            {
+                return {};
+            }
+
+            static void encode(const std::monostate &, std::vector<expression> &)
+            {
+            }
+
+            static std::monostate build(std::any *)
+            {
+                return {};
+            }
+        };
+
+        template <class T, class Indices>
+        struct product;
+
+        template <class T, std::size_t... I>
+        struct product<T, std::index_sequence<I...>> {
+            static std::vector<shape_ref> forms()
+            {
+                return {&traits<std::tuple_element_t<I, T>>::form...};
+            }
+
+            static void encode(const T &x, std::vector<expression> &fields)
+            {
+                (fields.push_back(traits<std::tuple_element_t<I, T>>::encode(std::get<I>(x))), ...);
+            }
+
+            static T build(std::any *children)
+            {
+                return T(std::any_cast<std::tuple_element_t<I, T>>(std::move(children[I]))...);
+            }
+        };
+
+        template <class... Ts>
+        struct members<std::tuple<Ts...>> : product<std::tuple<Ts...>, std::index_sequence_for<Ts...>> {
+        };
+
+        template <class T, class U>
+        struct members<std::pair<T, U>> : product<std::pair<T, U>, std::index_sequence<0, 1>> {
+        };
+
+        /**
+         * @brief フィールドを組み立てて constructor を作る
+         * @param[in] index コンストラクタの番号
+         * @param[in] count コンストラクタの数
+         * @param[in] fields フィールド
+         * @return 作った値
+         */
+        inline expression construct(std::size_t index, std::size_t count, std::vector<expression> &&fields)
+        {
+            if (fields.empty()) {
+                return native::constructor{index, count, nullptr};
+            }
+            return native::constructor{index, count, std::make_shared<std::vector<expression>>(std::move(fields))};
+        }
+
+        /** コンストラクタ一つの型 */
+        template <class T>
+        struct single {
+            static expression encode(const T &x)
+            {
+                std::vector<expression> fields;
+                members<T>::encode(x, fields);
+                return construct(0, 1, std::move(fields));
+            }
+
+            static const shape &form()
+            {
+                static const shape s{
+                    shape::kind::constructors, nullptr, {members<T>::forms()}, nullptr,
+                    [](std::size_t, std::any *children, std::size_t) {
+                        return std::any(members<T>::build(children));
+                    }};
+                return s;
+            }
+        };
+
+        template <class... Ts>
+        struct traits<std::tuple<Ts...>> : single<std::tuple<Ts...>> {
+        };
+
+        template <class T, class U>
+        struct traits<std::pair<T, U>> : single<std::pair<T, U>> {
+        };
+
+        template <>
+        struct traits<std::monostate> : single<std::monostate> {
+        };
+
+        /** 直和型は選択肢ごとのコンストラクタ */
+        template <class... Ts>
+        struct traits<std::variant<Ts...>> {
+        private:
+            using type = std::variant<Ts...>;
+
+            template <std::size_t... I>
+            static expression encode(const type &x, std::index_sequence<I...>)
+            {
+                static constexpr std::array<void (*)(const type &, std::vector<expression> &), sizeof...(Ts)> encoders{
+                    [](const type &x, std::vector<expression> &fields) {
+                        members<Ts>::encode(std::get<I>(x), fields);
+                    }...};
+                std::vector<expression> fields;
+                encoders[x.index()](x, fields);
+                return construct(x.index(), sizeof...(Ts), std::move(fields));
+            }
+
+            template <std::size_t... I>
+            static std::any build(std::size_t index, std::any *children, std::index_sequence<I...>)
+            {
+                static constexpr std::array<std::any (*)(std::any *), sizeof...(Ts)> builders{
+                    [](std::any *children) {
+                        return std::any(type(std::in_place_index<I>, members<Ts>::build(children)));
+                    }...};
+                return builders[index](children);
+            }
+
+        public:
+            static expression encode(const type &x)
+            {
+                return encode(x, std::index_sequence_for<Ts...>());
+            }
+
+            static const shape &form()
+            {
+                static const shape s{
+                    shape::kind::constructors, nullptr, {members<Ts>::forms()...}, nullptr,
+                    [](std::size_t index, std::any *children, std::size_t) {
+                        return build(index, children, std::index_sequence_for<Ts...>());
+                    }};
+                return s;
+            }
+        };
+
+        /** 配列はスコットリスト */
+        template <class T>
+        struct traits<std::vector<T>> {
+            static expression encode(const std::vector<T> &x)
+            {
+                std::vector<expression> items;
+                items.reserve(x.size());
+                for (const auto &item : x) {
+                    items.push_back(traits<T>::encode(item));
+                }
+                return scott_encode(items.begin(), items.end());
+            }
+
+            static const shape &form()
+            {
+                static const shape s{
+                    shape::kind::list, nullptr, {}, &traits<T>::form,
+                    [](std::size_t, std::any *children, std::size_t n) {
+                        std::vector<T> items;
+                        items.reserve(n);
+                        for (std::size_t i = 0; i < n; ++i) {
+                            items.push_back(std::any_cast<T>(std::move(children[i])));
+                        }
+                        return std::any(std::move(items));
+                    }};
+                return s;
+            }
+        };
+
+        /**
+         * @brief 共有ポインタは指す先の値
+         * @detail 指す先のエンコードは必要になるまで遅延されるので、再帰的な型は共有ポインタを通して表すとよい。
+         * 空のポインタはエンコードできない。
+         */
+        template <class T>
+        struct traits<std::shared_ptr<T>> {
+            static expression encode(const std::shared_ptr<T> &x)
+            {
+                return expression([x](expression) { return traits<std::remove_const_t<T>>::encode(*x); })(combinators::I);
+            }
+
+            static const shape &form()
+            {
+                static const shape s{
+                    shape::kind::wrapper, nullptr, {}, &traits<std::remove_const_t<T>>::form,
+                    [](std::size_t, std::any *children, std::size_t) {
+                        return std::any(std::shared_ptr<T>(std::make_shared<std::remove_const_t<T>>(std::any_cast<std::remove_const_t<T>>(std::move(children[0])))));
+                    }};
+                return s;
+            }
+        };
+
+        /**
+         * @brief 値がどのコンストラクタで作られたかを調べる
+         * @param[in] e 調べる値
+         * @param[in] constructors 各コンストラクタのフィールドの形
+         * @return コンストラクタの番号とフィールド
+         * @detail ライブラリが作った値でなければ、フィールドを集める関数を場合分けとして与えて調べる。
+         */
+        inline native::constructor match(const expression &e, const std::vector<std::vector<shape_ref>> &constructors)
+        {
+            std::size_t count = constructors.size();
+            auto fits = [&](const native::constructor *c) {
+                return c && c->count == count && c->index < count && c->arity() == constructors[c->index].size();
+            };
+            if (auto c = native_cast<native::constructor>(e); fits(c)) {
+                return *c;
+            }
+            expression matched = e;
+            for (std::size_t i = 0; i < count; ++i) {
+                std::size_t arity = constructors[i].size();
+                matched = matched(arity ? expression(native::collector{i, count, arity, nullptr}) : expression(native::constructor{i, count, nullptr}));
+            }
+            if (auto c = native_cast<native::constructor>(matched); fits(c)) {
+                return *c;
+            }
+            throw std::invalid_argument("lambda::adt_decode: the expression does not match the expected type");
+        }
+
+        /**
+         * @brief 形に従って値をデコードする
+         * @param[in] form 値の形
+         * @param[in] e デコードするラムダ式
+         * @return デコード結果
+         * @detail 明示的なスタックを使うので、深い木でもコールスタックを消費しない。
+         */
+        inline std::any decode(const shape &form, const expression &e)
+        {
+            struct task {
+                const shape *form;
+                expression term;
+                bool ready;
+                std::size_t index;
+                std::size_t count;
+            };
+            std::vector<task> tasks{{&form, e, false, 0, 0}};
+            std::vector<std::any> values;
+            while (!tasks.empty()) {
+                task t = std::move(tasks.back());
+                tasks.pop_back();
+                if (t.ready) {
+                    std::size_t first = values.size() - t.count;
+                    std::any value = t.form->build(t.index, values.data() + first, t.count);
+                    values.resize(first);
+                    values.push_back(std::move(value));
+                    continue;
+                }
+                switch (t.form->form) {
+                case shape::kind::leaf:
+                    values.push_back(t.form->leaf(t.term));
+                    break;
+                case shape::kind::wrapper:
+                    tasks.push_back({t.form, expression(), true, 0, 1});
+                    tasks.push_back({&t.form->inner(), std::move(t.term), false, 0, 0});
+                    break;
+                case shape::kind::list: {
+                    std::vector<expression> items;
+                    scott_decode(t.term, std::back_inserter(items));
+                    tasks.push_back({t.form, expression(), true, 0, items.size()});
+                    const shape *inner = &t.form->inner();
+                    for (std::size_t i = items.size(); i-- > 0;) {
+                        tasks.push_back({inner, std::move(items[i]), false, 0, 0});
+                    }
+                    break;
+                }
+                case shape::kind::constructors: {
+                    native::constructor c = match(t.term, t.form->constructors);
+                    const auto &fields = t.form->constructors[c.index];
+                    tasks.push_back({t.form, expression(), true, c.index, fields.size()});
+                    for (std::size_t i = fields.size(); i-- > 0;) {
+                        tasks.push_back({&fields[i](), (*c.fields)[i], false, 0, 0});
+                    }
+                    break;
+                }
+                }
+            }
+            return std::move(values.back());
+        }
+    }
+
+    /**
+     * @brief C++ の値をスコットエンコーディングによるラムダ式にする
+     * @param[in] x エンコードする値
+     * @return エンコード結果
+     * @detail 符号なし整数はチャーチ数、bool はチャーチブール値、std::vector はスコットリスト、
+     * std::tuple と std::pair はコンストラクタ一つ、std::variant は選択肢ごとのコンストラクタになる。
+     * それ以外の型は lambda::adt::representation を特殊化して既知の型に対応付ける。
+     */
+    template <class T>
+    inline expression adt_encode(const T &x)
+    {
+        return adt::traits<T>::encode(x);
+    }
+
+    /**
+     * @brief スコットエンコーディングによるラムダ式を C++ の値に戻す
+     * @param[in] e デコードするラムダ式
+     * @return デコード結果
+     * @detail adt_encode で作ったものに限らず、同じ形をしたラムダ式であればデコードできる。
+     * 形が合わないときは std::invalid_argument を投げる。
+     */
+    template <class T>
+    inline T adt_decode(const expression &e)
+    {
+        return std::any_cast<T>(adt::decode(adt::traits<T>::form(), e));
+    }
+}
@@ -0,0 +1,365 @@
+/**
+ * @file lambda-batch.hpp
+ * @brief 大量の入力に対するラムダ計算によるプログラムの実行を、複数のプロセスに分けて行います。
+ */
+
+#pragma once
+
+#include "lambda-expression.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace lambda {
+    /**
+     * @brief run_on_batch の設定
+     */
+    struct batch_options {
+        /** ワーカープロセスの数。入力はこの数の連続した区間に分けられる */
+        std::size_t workers = std::max(1l, sysconf(_SC_NPROCESSORS_ONLN));
+
+        /** 各ワーカーのアドレス空間の上限 (バイト)。0 なら制限しない */
+        std::size_t memory_limit = 0;
+
+        /** 各ワーカーが結果を書き込むリングバッファの大きさ (バイト) */
+        std::size_t ring_size = 1 << 20;
+
+        /** 一つの区間について、異常終了したワーカーを起動し直す回数の上限 */
+        std::size_t max_restarts = 3;
+    };
+
+    namespace batch {
+        /**
+         * @brief プロセス間で共有されたメモリ上の、書き手と読み手が一つずつのリングバッファ
+         * @detail 64 ビットの語を単位とし、書き込んだ語数と読み出した語数を別々のキャッシュラインに置く。
+         * 書き手が途中で落ちても、公開済みの語だけが読み手に見える。
+         */
+        class ring final {
+        private:
+            struct header {
+                alignas(64) std::atomic<std::uint64_t> head;
+                alignas(64) std::atomic<std::uint64_t> tail;
+            };
+
+            static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "the ring needs lock-free 64-bit atomics to be shared between processes");
+
+            header *_header;
+            std::uint64_t *_words;
+            std::size_t _mask;
+
+        public:
+            /**
+             * @param[in] memory 共有メモリ上の領域。bytes(capacity) バイトあること
+             * @param[in] capacity 語数。2 のべき乗であること
+             */
+            ring(void *memory, std::size_t capacity)
+                : _header(new (memory) header()), _words(reinterpret_cast<std::uint64_t *>(_header + 1)), _mask(capacity - 1)
+            {
+            }
+
+            /** capacity 語のリングに必要なバイト数 */
+            static std::size_t bytes(std::size_t capacity)
+            {
+                return sizeof(header) + capacity * sizeof(std::uint64_t);
+            }
+
+            /**
+             * @brief 語の並びを書き込んで公開する
+             * @param[in] words 書き込む語
+             * @param[in] n 語数
+             * @param[in] wait 空きを待つ間に繰り返し呼び出す関数
+             */
+            template <class Wait>
+            void write(const std::uint64_t *words, std::size_t n, Wait wait)
+            {
+                std::uint64_t head = _header->head.load(std::memory_order_relaxed);
+                while (n) {
+                    std::uint64_t tail = _header->tail.load(std::memory_order_acquire);
+                    std::size_t room = std::min<std::uint64_t>(n, _mask + 1 - (head - tail));
+                    if (!room) {
+                        wait();
+                        continue;
+                    }
+                    for (std::size_t i = 0; i < room; ++i) {
+                        _words[(head + i) & _mask] = words[i];
+                    }
+                    head += room;
+                    words += room;
+                    n -= room;
+                    _header->head.store(head, std::memory_order_release);
+                }
+            }
+
+            /**
+             * @brief 公開済みの語を読み出す
+             * @param[in] visit 各語に対して呼び出す関数
+             * @return 読み出した語数
+             */
+            template <class Visitor>
+            std::size_t read(Visitor visit)
+            {
+                std::uint64_t tail = _header->tail.load(std::memory_order_relaxed);
+                std::uint64_t head = _header->head.load(std::memory_order_acquire);
+                for (std::uint64_t i = tail; i != head; ++i) {
+                    visit(_words[i & _mask]);
+                }
+                _header->tail.store(head, std::memory_order_release);
+                return head - tail;
+            }
+
+            /** 空にする。書き手がいないときにだけ呼び出すこと */
+            void reset()
+            {
+                _header->head.store(0, std::memory_order_relaxed);
+                _header->tail.store(0, std::memory_order_relaxed);
+            }
+        };
+
+        /** 待つ回数に応じて、譲るだけから短く眠るまで段階的に待ち方を変える */
+        inline void back_off(std::size_t &attempts)
+        {
+            if (++attempts < 64) {
+                sched_yield();
+                return;
+            }
+            struct timespec pause = {0, 50000};
+            nanosleep(&pause, nullptr);
+        }
+
+        /**
+         * @brief ワーカープロセスの本体
+         * @param[in] batch 入力の一覧
+         * @param[in] first 処理する区間の始まり
+         * @param[in] last 処理する区間の終わり
+         * @param[in] program 実行するラムダ式
+         * @param[in] results 結果を書き込むリング
+         * @detail 各入力の結果は、要素数に続けて各要素を並べたレコードとして書き込む。
+         */
+        template <class Batch>
+        [[noreturn]] inline void work(const Batch &batch, std::size_t first, std::size_t last, const expression &program, ring &results)
+        {
+            pid_t parent = getppid();
+            std::size_t attempts = 0;
+            auto wait = [parent, &attempts] {
+                if (getppid() != parent) {
+                    _exit(1);
+                }
+                back_off(attempts);
+            };
+            try {
+                std::vector<std::uint64_t> record;
+                for (std::size_t i = first; i < last; ++i) {
+                    record.assign(1, 0);
+                    run_on_integer_sequence(std::begin(batch[i]), std::end(batch[i]), program, std::back_inserter(record));
+                    record[0] = record.size() - 1;
+                    results.write(record.data(), record.size(), wait);
+                    attempts = 0;
+                }
+            } catch (...) {
+                _exit(1);
+            }
+            _exit(0);
+        }
+
+        /** 一つのワーカーが受け持つ区間の様子 */
+        struct shard {
+            std::size_t first;
+            std::size_t last;
+            pid_t pid = -1;
+            std::size_t restarts = 0;
+
+            /** 受け取り終えたレコードの数 */
+            std::size_t received = 0;
+
+            /** 受け取ったがまだ利用者に渡していないレコード */
+            std::deque<std::vector<std::size_t>> pending;
+
+            /** 読み途中のレコードの要素と、その残りの要素数 */
+            std::vector<std::size_t> partial;
+            std::size_t remaining = 0;
+            bool in_record = false;
+
+            /**
+             * @brief リングから読み出した一語を受け取る
+             * @param[in] word 語
+             */
+            void take(std::uint64_t word)
+            {
+                if (!in_record) {
+                    partial.clear();
+                    remaining = word;
+                    in_record = true;
+                } else {
+                    partial.push_back(word);
+                    --remaining;
+                }
+                if (in_record && !remaining) {
+                    pending.push_back(std::move(partial));
+                    partial = {};
+                    in_record = false;
+                    ++received;
+                }
+            }
+        };
+    }
+
+    /**
+     * @brief 入力の一覧に対しラムダ計算によるプログラムを複数のプロセスで実行する
+     * @param[in] batch 入力の一覧。size() と添字による参照を持ち、batch[i] は自然数の範囲であること
+     * @param[in] program 実行するラムダ式
+     * @param[in] visit 結果を受け取る関数。入力の順に (添字, 結果の自然数の列) で呼び出される
+     * @param[in] options 設定
+     * @detail batch を options.workers 個の連続した区間に分け、区間ごとに fork したワーカープロセスで
+     * run_on_integer_sequence と同じ処理を行う。program は fork 前に組み立てたものがそのまま共有される。
+     * 結果は区間ごとの共有メモリ上のリングバッファを介して親へ渡され、親は入力の順にそれを取り出す。
+     * 前の区間の結果を待っている間も後ろの区間のリングは読み出して手元に溜めておくので、ワーカーは並行して進む。
+     * ワーカーが異常終了したり options.memory_limit を超えたりしたときは、その区間の
+     * まだ結果を受け取っていない入力から、ワーカーを起動し直して続ける。
+     * 起動し直した回数が options.max_restarts を超えたら残りのワーカーを止めて std::runtime_error を投げる。
+     * ネットワークは使わない。ほかのスレッドがロックを握っている間に呼び出さないこと。
+     */
+    template <class Batch, class Visitor>
+    inline void run_on_batch(const Batch &batch, const expression &program, Visitor visit, const batch_options &options = batch_options())
+    {
+        std::size_t total = batch.size();
+        std::size_t workers = std::max<std::size_t>(1, std::min(options.workers, total));
+        std::size_t capacity = 1;
+        while (capacity * sizeof(std::uint64_t) < options.ring_size) {
+            capacity <<= 1;
+        }
+        std::size_t stride = (batch::ring::bytes(capacity) + 63) / 64 * 64;
+        void *memory = mmap(nullptr, stride * workers, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "lambda::run_on_batch");
+        }
+        std::vector<batch::ring> rings;
+        std::vector<batch::shard> shards;
+        for (std::size_t k = 0; k < workers; ++k) {
+            rings.emplace_back(static_cast<char *>(memory) + stride * k, capacity);
+            shards.push_back({total * k / workers, total * (k + 1) / workers});
+        }
+
+        /* 抜けるときは例外であっても、残っているワーカーを止めて共有メモリを手放す */
+        struct cleanup {
+            std::vector<batch::shard> &shards;
+            void *memory;
+            std::size_t size;
+
+            ~cleanup()
+            {
+                for (auto &s : shards) {
+                    if (s.pid > 0) {
+                        kill(s.pid, SIGKILL);
+                        while (waitpid(s.pid, nullptr, 0) < 0 && errno == EINTR) {
+                        }
+                    }
+                }
+                munmap(memory, size);
+            }
+        } guard{shards, memory, stride * workers};
+
+        auto start = [&](std::size_t k) {
+            batch::shard &s = shards[k];
+            std::size_t from = s.first + s.received;
+            if (from == s.last) {
+                return;
+            }
+            pid_t pid = fork();
+            if (pid < 0) {
+                throw std::system_error(errno, std::generic_category(), "lambda::run_on_batch");
+            }
+            if (pid == 0) {
+                prctl(PR_SET_PDEATHSIG, SIGKILL);
+                if (options.memory_limit) {
+                    struct rlimit limit = {options.memory_limit, options.memory_limit};
+                    setrlimit(RLIMIT_AS, &limit);
+                }
+                batch::work(batch, from, s.last, program, rings[k]);
+            }
+            s.pid = pid;
+        };
+
+        /* 終了したワーカーを片付け、異常終了していれば読み残しを引き取ってから起動し直す */
+        auto reap = [&](std::size_t k) {
+            batch::shard &s = shards[k];
+            int status;
+            pid_t r = waitpid(s.pid, &status, WNOHANG);
+            if (r == 0 || (r < 0 && errno == EINTR)) {
+                return;
+            }
+            s.pid = -1;
+            rings[k].read([&s](std::uint64_t word) { s.take(word); });
+            if (s.first + s.received == s.last) {
+                return;
+            }
+            if (r > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                throw std::logic_error("lambda::run_on_batch: a worker exited without finishing its shard");
+            }
+            if (++s.restarts > options.max_restarts) {
+                throw std::runtime_error("lambda::run_on_batch: the shard starting at " + std::to_string(s.first + s.received) + " kept failing");
+            }
+            /* 書きかけのレコードは捨て、受け取り終えた次の入力からやり直す */
+            s.in_record = false;
+            rings[k].reset();
+            start(k);
+        };
+
+        for (std::size_t k = 0; k < workers; ++k) {
+            start(k);
+        }
+        for (std::size_t k = 0; k < workers; ++k) {
+            batch::shard &s = shards[k];
+            std::size_t index = s.first;
+            std::size_t attempts = 0;
+            while (index < s.last) {
+                if (s.pending.empty()) {
+                    /* 先の区間のリングも空けておき、その区間のワーカーが書き込みを待って止まらないようにする */
+                    bool received = false;
+                    for (std::size_t j = k; j < workers; ++j) {
+                        batch::shard &t = shards[j];
+                        if (rings[j].read([&t](std::uint64_t word) { t.take(word); })) {
+                            received = true;
+                        }
+                    }
+                    if (s.pending.empty()) {
+                        for (std::size_t j = k; j < workers; ++j) {
+                            if (shards[j].pid > 0) {
+                                reap(j);
+                            }
+                        }
+                        if (!received) {
+                            batch::back_off(attempts);
+                        }
+                        continue;
+                    }
+                }
+                attempts = 0;
+                while (!s.pending.empty()) {
+                    visit(index++, s.pending.front());
+                    s.pending.pop_front();
+                }
+            }
+            if (s.pid > 0) {
+                while (waitpid(s.pid, nullptr, 0) < 0 && errno == EINTR) {
+                }
+                s.pid = -1;
+            }
+        }
+    }
+}
@@ -0,0 +1,960 @@
+/**
+ * @file lambda-checkpoint.hpp
+ * @brief 評価途中のラムダ式をファイルに書き出し、後から、あるいは別のプロセスで読み戻します。
+ */
+
+#pragma once
+
+#include "lambda-adt.hpp"
+#include "lambda-expression.hpp"
+#include "lambda-io.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace lambda {
+    namespace checkpoint {
+        /**
+         * @brief 書き出せる関数の名簿
+         * @detail ネイティブ表現を持たない関数は、名簿に載っていれば名前として書き出す。
+         * 関数はその実装の型で見分けるので、載せられるのは何も捕捉しない関数だけである。
+         */
+        class registry {
+        private:
+            std::map<std::string, expression> _by_name;
+            std::unordered_map<std::type_index, std::string> _by_type;
+
+        public:
+            /**
+             * @brief 関数を名簿に載せる
+             * @param[in] name 書き出すときの名前
+             * @param[in] f 何も捕捉しない関数
+             */
+            void add(const std::string &name, const expression &f);
+
+            /**
+             * @brief 関数の名前を調べる
+             * @param[in] f 調べる関数
+             * @return 名前へのポインタ。載っていなければ nullptr
+             */
+            const std::string *name_of(const expression &f) const
+            {
+                auto it = _by_type.find(f_type(f));
+                return it == _by_type.end() ? nullptr : &it->second;
+            }
+
+            /**
+             * @brief 名前から関数を引く
+             * @param[in] name 名前
+             * @return 関数へのポインタ。載っていなければ nullptr
+             */
+            const expression *find(const std::string &name) const
+            {
+                auto it = _by_name.find(name);
+                return it == _by_name.end() ? nullptr : &it->second;
+            }
+
+            /** combinators にある関数をすべて載せた名簿 */
+            static const registry &standard();
+
+        private:
+            static std::type_index f_type(const expression &f);
+        };
+
+        /** 非公開の内部表現を覗くための窓口 */
+        struct access {
+            using thunk = expression::thunk;
+            using tree = native::sequence::tree;
+            using node = native::sequence::node;
+
+            template <class T>
+            static const T *target(const expression &e)
+            {
+                return e.target<T>();
+            }
+
+            static const std::type_info &type(const expression &e)
+            {
+                return e.type();
+            }
+
+            static bool empty(const expression &e)
+            {
+                return !static_cast<const std::function<expression(expression)> &>(e);
+            }
+
+            /** 評価済みのサンクを読み飛ばす */
+            static const expression &resolve(const expression &e)
+            {
+                const expression *p = &e;
+                while (auto t = p->target<thunk>()) {
+                    const expression *v = t->evaluated();
+                    if (!v) {
+                        break;
+                    }
+                    p = v;
+                }
+                return *p;
+            }
+
+            /**
+             * @brief 未評価のサンクの中身を得る
+             * @return 関数と引数へのポインタの組。評価中であれば nullptr の組
+             */
+            static std::pair<const expression *, const expression *> application(const thunk &t)
+            {
+                const thunk::cell *c = t._cell.get();
+                if (c->state.load(std::memory_order_acquire) != thunk::unevaluated) {
+                    return {nullptr, nullptr};
+                }
+                return {&c->function, &c->argument};
+            }
+
+            /**
+             * @brief サンクのセルにある関数と引数を得る
+             * @return 関数と引数へのポインタの組。評価を終えたあとは空の式を指す
+             */
+            static std::pair<const expression *, const expression *> operands(const thunk &t)
+            {
+                const thunk::cell *c = t._cell.get();
+                return {&c->function, &c->argument};
+            }
+
+            /** サンクのセルの大きさ */
+            static constexpr std::size_t cell_size = sizeof(thunk::cell);
+
+            static const void *identity(const thunk &t)
+            {
+                return t._cell.get();
+            }
+
+            static const native::list &source(const native::pipeline &q)
+            {
+                return q._state->source;
+            }
+
+            static const std::vector<native::pipeline::stage> &stages(const native::pipeline &q)
+            {
+                return q._state->stages;
+            }
+
+            /** 実体化済みであればその結果 */
+            static const native::list *materialized(const native::pipeline &q)
+            {
+                return q._state->ready.load(std::memory_order_acquire) ? &q._state->value : nullptr;
+            }
+
+            static const tree &root(const native::sequence &q)
+            {
+                return q._root;
+            }
+
+            static native::sequence sequence(tree root)
+            {
+                return native::sequence(std::move(root));
+            }
+
+            static tree branch(tree left, expression value, tree right)
+            {
+                return native::sequence::make(std::move(left), std::move(value), std::move(right));
+            }
+        };
+
+        inline std::type_index registry::f_type(const expression &f)
+        {
+            return access::type(access::resolve(f));
+        }
+
+        inline void registry::add(const std::string &name, const expression &f)
+        {
+            _by_name[name] = f;
+            _by_type[f_type(f)] = name;
+        }
+
+        inline const registry &registry::standard()
+        {
+            static const registry r = [] {
+                registry r;
+                std::pair<const char *, const expression &> entries[] = {
+                    {"Y", combinators::Y},
+                    {"I", combinators::I},
+                    {"K", combinators::K},
+                    {"S", combinators::S},
+                    {"i", combinators::i},
+                    {"succ", combinators::succ},
+                    {"pred", combinators::pred},
+                    {"add", combinators::add},
+                    {"sub", combinators::sub},
+                    {"mult", combinators::mult},
+                    {"power", combinators::power},
+                    {"is_zero", combinators::is_zero},
+                    {"leq", combinators::leq},
+                    {"eq", combinators::eq},
+                    {"min", combinators::min},
+                    {"max", combinators::max},
+                    {"quot", combinators::quot},
+                    {"rem", combinators::rem},
+                    {"cons", combinators::cons},
+                    {"car", combinators::car},
+                    {"cdr", combinators::cdr},
+                    {"is_empty", combinators::is_empty},
+                    {"length", combinators::length},
+                    {"map", combinators::map},
+                    {"foldl", combinators::foldl},
+                    {"foldr", combinators::foldr},
+                    {"append", combinators::append},
+                    {"reverse", combinators::reverse},
+                    {"nth", combinators::nth},
+                    {"take", combinators::take},
+                    {"drop", combinators::drop},
+                    {"update", combinators::update},
+                    {"filter", combinators::filter},
+                };
+                for (const auto &[name, f] : entries) {
+                    r.add(name, f);
+                }
+                return r;
+            }();
+            return r;
+        }
+
+        /** 書き出した各節の種類 */
+        enum class tag : unsigned char {
+            empty,       /**< 空の式 */
+            numeral,     /**< 値 */
+            boolean,     /**< 値 */
+            constant,    /**< 値の式 */
+            pair,        /**< 先頭と残りの式 */
+            array,       /**< 要素数と各要素の式 */
+            list,        /**< 配列, 始まり, 終わり */
+            pipeline,    /**< 配列, 始まり, 終わり, 段数, 各段の種類と式 */
+            branch,      /**< 平衡二分木の節。左の部分木, 値の式, 右の部分木 */
+            sequence,    /**< 根の節 */
+            application, /**< 未評価の適用。関数と引数の式 */
+            named,       /**< 名簿に載っている関数の名前 */
+            constructor, /**< 何番目か, コンストラクタの数, フィールドの配列 */
+            choice,      /**< 何番目か, 受け取った数, コンストラクタの数, 選ばれた関数の式, フィールドの配列 */
+            collector,   /**< 何番目か, コンストラクタの数, フィールドの数, 集めたフィールドの配列 */
+            fixpoint,    /**< 不動点を求める関数の式 */
+            partial,     /**< 組み込みのコンビネータの名前, 受け取った数, 受け取った引数の式 */
+            sum          /**< 評価済みの値, 足す式のリスト */
+        };
+
+        static constexpr char magic[4] = {'L', 'M', 'C', 'K'};
+        static constexpr std::size_t version = 1;
+
+        /**
+         * @brief ラムダ式が指すデータの網を、共有を保ったまま節の並びとして書き出す
+         * @detail 節は子より後に並べ、子は番号に 1 を足した値で参照する。0 は何もないことを表す。
+         * 深いリストでもスタックを溢れさせないよう、明示的なスタックを使って反復的に辿る。
+         */
+        class writer {
+        private:
+            enum class kind {
+                expression,
+                array,
+                branch
+            };
+
+            struct frame {
+                kind what;
+                const void *p;
+                bool expanded;
+            };
+
+            /** 節を同一視するための鍵。セルの先頭と最初の要素のように番地が重なることがあるので、何の番地かも添える */
+            struct identity {
+                const void *p;
+                int what;
+
+                bool operator==(const identity &other) const
+                {
+                    return p == other.p && what == other.what;
+                }
+            };
+
+            struct hash {
+                std::size_t operator()(const identity &k) const
+                {
+                    return std::hash<const void *>()(k.p) ^ static_cast<std::size_t>(k.what);
+                }
+            };
+
+            const registry &_registry;
+            std::string _out;
+            std::unordered_map<identity, std::size_t, hash> _numbers;
+            std::size_t _count = 0;
+
+            void put(std::size_t n)
+            {
+                for (; n >= 0x80; n >>= 7) {
+                    _out.push_back(static_cast<char>((n & 0x7f) | 0x80));
+                }
+                _out.push_back(static_cast<char>(n));
+            }
+
+            void put(tag t)
+            {
+                _out.push_back(static_cast<char>(t));
+            }
+
+            /** 式の鍵。共有されたセルを持つものはそのセルで、名簿に載っている関数はその型で見分ける */
+            identity identify(const expression &e) const
+            {
+                if (access::empty(e)) {
+                    return {nullptr, 0};
+                }
+                if (auto t = access::target<access::thunk>(e)) {
+                    return {access::identity(*t), 1};
+                }
+                if (auto p = access::target<native::pair>(e)) {
+                    return {&p->first(), 2};
+                }
+                if (_registry.name_of(e)) {
+                    return {&access::type(e), 3};
+                }
+                return {&e, 4};
+            }
+
+            identity key(const frame &f) const
+            {
+                if (f.what == kind::expression) {
+                    return identify(*static_cast<const expression *>(f.p));
+                }
+                return {f.p, f.what == kind::array ? 5 : 6};
+            }
+
+            /**
+             * @brief 子を順に訪れる
+             * @param[in] f 節
+             * @param[in] visit 子の種類とポインタを受け取る関数。ポインタは nullptr のこともある
+             */
+            template <class Visitor>
+            void each_child(const frame &f, Visitor visit) const
+            {
+                if (f.what == kind::array) {
+                    for (const auto &x : *static_cast<const std::vector<expression> *>(f.p)) {
+                        visit(kind::expression, &access::resolve(x));
+                    }
+                    return;
+                }
+                if (f.what == kind::branch) {
+                    auto t = static_cast<const access::node *>(f.p);
+                    visit(kind::branch, t->left.get());
+                    visit(kind::expression, &access::resolve(t->value));
+                    visit(kind::branch, t->right.get());
+                    return;
+                }
+                const expression &e = *static_cast<const expression *>(f.p);
+                auto expr = [&visit](const expression &x) {
+                    visit(kind::expression, &access::resolve(x));
+                };
+                if (auto t = access::target<access::thunk>(e)) {
+                    auto [function, argument] = access::application(*t);
+                    if (!function) {
+                        throw std::invalid_argument("lambda::checkpoint: the expression is being evaluated");
+                    }
+                    expr(*function);
+                    expr(*argument);
+                } else if (auto c = access::target<native::constant>(e)) {
+                    expr(c->value);
+                } else if (auto s = access::target<native::sum>(e)) {
+                    expr(s->terms);
+                } else if (auto p = access::target<native::pair>(e)) {
+                    expr(p->first());
+                    expr(p->second());
+                } else if (auto v = access::target<native::list>(e)) {
+                    visit(kind::array, v->items.get());
+                } else if (auto q = access::target<native::pipeline>(e)) {
+                    if (auto v = access::materialized(*q)) {
+                        visit(kind::array, v->items.get());
+                    } else {
+                        visit(kind::array, access::source(*q).items.get());
+                        for (const auto &s : access::stages(*q)) {
+                            expr(s.function);
+                        }
+                    }
+                } else if (auto q = access::target<native::sequence>(e)) {
+                    visit(kind::branch, access::root(*q).get());
+                } else if (auto c = access::target<native::constructor>(e)) {
+                    visit(kind::array, c->fields.get());
+                } else if (auto c = access::target<native::choice>(e)) {
+                    expr(c->handler);
+                    visit(kind::array, c->fields.get());
+                } else if (auto c = access::target<native::collector>(e)) {
+                    visit(kind::array, c->fields.get());
+                } else if (auto y = access::target<native::fixpoint>(e)) {
+                    expr(y->function);
+                } else if (auto p = access::target<native::partial>(e)) {
+                    for (std::size_t i = 0; i < p->count; ++i) {
+                        expr(p->args[i]);
+                    }
+                }
+            }
+
+            void ref(kind what, const void *p)
+            {
+                if (!p) {
+                    put(std::size_t(0));
+                    return;
+                }
+                frame f{what, p, false};
+                put(_numbers.at(key(f)) + 1);
+            }
+
+            void ref(const expression &e)
+            {
+                ref(kind::expression, &access::resolve(e));
+            }
+
+            void range(const native::list &v)
+            {
+                ref(kind::array, v.items.get());
+                put(v.first);
+                put(v.last);
+            }
+
+            /** 子をすべて書き出し終えた節を書き出す */
+            void emit(const frame &f)
+            {
+                if (f.what == kind::array) {
+                    auto &items = *static_cast<const std::vector<expression> *>(f.p);
+                    put(tag::array);
+                    put(items.size());
+                    for (const auto &x : items) {
+                        ref(x);
+                    }
+                    return;
+                }
+                if (f.what == kind::branch) {
+                    auto t = static_cast<const access::node *>(f.p);
+                    put(tag::branch);
+                    ref(kind::branch, t->left.get());
+                    ref(t->value);
+                    ref(kind::branch, t->right.get());
+                    return;
+                }
+                const expression &e = *static_cast<const expression *>(f.p);
+                if (access::empty(e)) {
+                    put(tag::empty);
+                } else if (auto t = access::target<access::thunk>(e)) {
+                    auto [function, argument] = access::application(*t);
+                    put(tag::application);
+                    ref(*function);
+                    ref(*argument);
+                } else if (auto k = access::target<native::numeral>(e)) {
+                    put(tag::numeral);
+                    put(k->value);
+                } else if (auto s = access::target<native::sum>(e)) {
+                    put(tag::sum);
+                    put(s->value);
+                    ref(s->terms);
+                } else if (auto b = access::target<native::boolean>(e)) {
+                    put(tag::boolean);
+                    put(std::size_t(b->value));
+                } else if (auto c = access::target<native::constant>(e)) {
+                    put(tag::constant);
+                    ref(c->value);
+                } else if (auto p = access::target<native::pair>(e)) {
+                    put(tag::pair);
+                    ref(p->first());
+                    ref(p->second());
+                } else if (auto v = access::target<native::list>(e)) {
+                    put(tag::list);
+                    range(*v);
+                } else if (auto q = access::target<native::pipeline>(e)) {
+                    if (auto v = access::materialized(*q)) {
+                        put(tag::list);
+                        range(*v);
+                    } else {
+                        put(tag::pipeline);
+                        range(access::source(*q));
+                        put(access::stages(*q).size());
+                        for (const auto &s : access::stages(*q)) {
+                            put(std::size_t(s.filter));
+                            ref(s.function);
+                        }
+                    }
+                } else if (auto q = access::target<native::sequence>(e)) {
+                    put(tag::sequence);
+                    ref(kind::branch, access::root(*q).get());
+                } else if (auto c = access::target<native::constructor>(e)) {
+                    put(tag::constructor);
+                    put(c->index);
+                    put(c->count);
+                    ref(kind::array, c->fields.get());
+                } else if (auto c = access::target<native::choice>(e)) {
+                    put(tag::choice);
+                    put(c->index);
+                    put(c->received);
+                    put(c->count);
+                    ref(c->handler);
+                    ref(kind::array, c->fields.get());
+                } else if (auto c = access::target<native::collector>(e)) {
+                    put(tag::collector);
+                    put(c->index);
+                    put(c->count);
+                    put(c->arity);
+                    ref(kind::array, c->fields.get());
+                } else if (auto y = access::target<native::fixpoint>(e)) {
+                    put(tag::fixpoint);
+                    ref(y->function);
+                } else if (auto p = access::target<native::partial>(e)) {
+                    std::string name = native::builtin::name(p->code);
+                    put(tag::partial);
+                    put(name.size());
+                    _out += name;
+                    put(std::size_t(p->count));
+                    for (std::size_t i = 0; i < p->count; ++i) {
+                        ref(p->args[i]);
+                    }
+                } else if (auto name = _registry.name_of(e)) {
+                    put(tag::named);
+                    put(name->size());
+                    _out += *name;
+                } else {
+                    throw std::invalid_argument("lambda::checkpoint: the expression contains a function that is not in the registry");
+                }
+            }
+
+        public:
+            explicit writer(const registry &r)
+                : _registry(r)
+            {
+            }
+
+            /**
+             * @brief 式を書き出す
+             * @param[in] root 書き出す式
+             * @return 書き出した結果
+             */
+            std::string write(const expression &root)
+            {
+                _out.assign(magic, sizeof(magic));
+                put(version);
+                std::string header = std::move(_out);
+                _out.clear();
+                std::vector<frame> stack{{kind::expression, &access::resolve(root), false}};
+                while (!stack.empty()) {
+                    frame f = stack.back();
+                    stack.pop_back();
+                    identity k = key(f);
+                    if (_numbers.count(k)) {
+                        continue;
+                    }
+                    if (!f.expanded) {
+                        stack.push_back({f.what, f.p, true});
+                        each_child(f, [this, &stack](kind what, const void *p) {
+                            if (p && !_numbers.count(key({what, p, false}))) {
+                                stack.push_back({what, p, false});
+                            }
+                        });
+                        continue;
+                    }
+                    each_child(f, [this](kind what, const void *p) {
+                        if (p && !_numbers.count(key({what, p, false}))) {
+                            /* サンクの値が自分自身を指すような循環は書き出せない */
+                            throw std::invalid_argument("lambda::checkpoint: the expression is cyclic");
+                        }
+                    });
+                    emit(f);
+                    _numbers.emplace(k, _count++);
+                }
+                std::string body = std::move(_out);
+                _out = std::move(header);
+                put(_count);
+                _out += body;
+                ref(root);
+                return std::move(_out);
+            }
+        };
+
+        /**
+         * @brief writer が書き出した節の並びを読み戻す
+         */
+        class reader {
+        private:
+            struct slot {
+                expression value;
+                std::shared_ptr<const std::vector<expression>> array;
+                access::tree branch;
+            };
+
+            const registry &_registry;
+            const unsigned char *_p;
+            const unsigned char *_end;
+            std::vector<slot> _slots;
+
+            [[noreturn]] static void corrupt()
+            {
+                throw std::runtime_error("lambda::checkpoint: the checkpoint is corrupt");
+            }
+
+            std::size_t get()
+            {
+                std::size_t n = 0;
+                for (unsigned shift = 0;; shift += 7) {
+                    if (_p == _end || shift >= sizeof(std::size_t) * 8) {
+                        corrupt();
+                    }
+                    unsigned char b = *_p++;
+                    n |= static_cast<std::size_t>(b & 0x7f) << shift;
+                    if (!(b & 0x80)) {
+                        return n;
+                    }
+                }
+            }
+
+            /** 参照を読む。何もなければ nullptr */
+            const slot *ref()
+            {
+                std::size_t n = get();
+                if (n > _slots.size()) {
+                    corrupt();
+                }
+                return n ? &_slots[n - 1] : nullptr;
+            }
+
+            const expression &expr()
+            {
+                const slot *s = ref();
+                if (!s) {
+                    corrupt();
+                }
+                return s->value;
+            }
+
+            std::shared_ptr<const std::vector<expression>> array()
+            {
+                const slot *s = ref();
+                return s ? s->array : nullptr;
+            }
+
+            access::tree branch()
+            {
+                const slot *s = ref();
+                return s ? s->branch : nullptr;
+            }
+
+            native::list range()
+            {
+                auto items = array();
+                std::size_t first = get(), last = get();
+                if (first > last || last > (items ? items->size() : 0)) {
+                    corrupt();
+                }
+                return native::list{std::move(items), first, last};
+            }
+
+            slot node()
+            {
+                if (_p == _end) {
+                    corrupt();
+                }
+                slot s;
+                switch (static_cast<tag>(*_p++)) {
+                case tag::empty:
+                    break;
+                case tag::numeral:
+                    s.value = native::numeral{get()};
+                    break;
+                case tag::sum: {
+                    std::size_t value = get();
+                    if (value == 0) {
+                        corrupt();
+                    }
+                    s.value = native::sum{value, expr()};
+                    break;
+                }
+                case tag::boolean:
+                    s.value = native::boolean{get() != 0};
+                    break;
+                case tag::constant:
+                    s.value = native::constant{expr()};
+                    break;
+                case tag::pair: {
+                    expression first = expr();
+                    s.value = native::pair{std::move(first), expr()};
+                    break;
+                }
+                case tag::array: {
+                    std::size_t n = get();
+                    if (n > static_cast<std::size_t>(_end - _p)) {
+                        corrupt();
+                    }
+                    auto items = std::make_shared<std::vector<expression>>();
+                    items->reserve(n);
+                    for (std::size_t i = 0; i < n; ++i) {
+                        items->push_back(expr());
+                    }
+                    s.array = std::move(items);
+                    break;
+                }
+                case tag::list:
+                    s.value = range();
+                    break;
+                case tag::pipeline: {
+                    native::list source = range();
+                    std::size_t n = get();
+                    if (n > static_cast<std::size_t>(_end - _p)) {
+                        corrupt();
+                    }
+                    std::vector<native::pipeline::stage> stages;
+                    for (std::size_t i = 0; i < n; ++i) {
+                        bool filter = get() != 0;
+                        stages.push_back({filter, expr()});
+                    }
+                    s.value = native::pipeline(std::move(source), std::move(stages));
+                    break;
+                }
+                case tag::branch: {
+                    access::tree left = branch();
+                    expression value = expr();
+                    s.branch = access::branch(std::move(left), std::move(value), branch());
+                    break;
+                }
+                case tag::sequence:
+                    s.value = access::sequence(branch());
+                    break;
+                case tag::application: {
+                    expression function = expr();
+                    s.value = function(expr());
+                    break;
+                }
+                case tag::named: {
+                    std::size_t n = get();
+                    if (n > static_cast<std::size_t>(_end - _p)) {
+                        corrupt();
+                    }
+                    std::string name(reinterpret_cast<const char *>(_p), n);
+                    _p += n;
+                    const expression *f = _registry.find(name);
+                    if (!f) {
+                        throw std::invalid_argument("lambda::checkpoint: unknown function '" + name + "'");
+                    }
+                    s.value = *f;
+                    break;
+                }
+                case tag::constructor: {
+                    std::size_t index = get(), count = get();
+                    if (index >= count) {
+                        corrupt();
+                    }
+                    s.value = native::constructor{index, count, array()};
+                    break;
+                }
+                case tag::choice: {
+                    std::size_t index = get(), received = get(), count = get();
+                    if (index >= count || received > count) {
+                        corrupt();
+                    }
+                    expression handler = expr();
+                    s.value = native::choice{index, received, count, std::move(handler), array()};
+                    break;
+                }
+                case tag::collector: {
+                    std::size_t index = get(), count = get(), arity = get();
+                    if (index >= count) {
+                        corrupt();
+                    }
+                    s.value = native::collector{index, count, arity, array()};
+                    break;
+                }
+                case tag::fixpoint:
+                    s.value = native::fixpoint{expr()};
+                    break;
+                case tag::partial: {
+                    std::size_t n = get();
+                    if (n > static_cast<std::size_t>(_end - _p)) {
+                        corrupt();
+                    }
+                    std::string name(reinterpret_cast<const char *>(_p), n);
+                    _p += n;
+                    std::size_t code = 0;
+                    while (code < native::ops && name != native::builtin::name(static_cast<native::op>(code))) {
+                        ++code;
+                    }
+                    std::size_t count = get();
+                    if (code == native::ops || count == 0 || count >= native::builtin::arity(static_cast<native::op>(code))) {
+                        corrupt();
+                    }
+                    native::partial p{static_cast<native::op>(code), static_cast<std::uint8_t>(count), {}};
+                    for (std::size_t i = 0; i < count; ++i) {
+                        p.args[i] = expr();
+                    }
+                    s.value = std::move(p);
+                    break;
+                }
+                default:
+                    corrupt();
+                }
+                return s;
+            }
+
+        public:
+            explicit reader(const registry &r)
+                : _registry(r)
+            {
+            }
+
+            /**
+             * @brief 式を読み戻す
+             * @param[in] data 書き出した結果の先頭
+             * @param[in] size バイト数
+             * @return 読み戻した式
+             */
+            expression read(const unsigned char *data, std::size_t size)
+            {
+                _p = data;
+                _end = data + size;
+                if (size < sizeof(magic) || !std::equal(magic, magic + sizeof(magic), reinterpret_cast<const char *>(data))) {
+                    corrupt();
+                }
+                _p += sizeof(magic);
+                if (get() != version) {
+                    corrupt();
+                }
+                std::size_t n = get();
+                if (n > size) {
+                    corrupt();
+                }
+                _slots.reserve(n);
+                for (std::size_t i = 0; i < n; ++i) {
+                    _slots.push_back(node());
+                }
+                expression root = expr();
+                if (_p != _end) {
+                    corrupt();
+                }
+                return root;
+            }
+        };
+    }
+
+    /**
+     * @brief 式をチェックポイントとしてバイト列に書き出す
+     * @param[in] e 書き出す式
+     * @param[in] names ネイティブ表現を持たない関数の名簿
+     * @return 書き出した結果
+     * @detail e から辿れるデータの網を、評価済みの部分は値として、未評価の適用は関数と引数の組として書き出す。
+     * 複数の箇所から共有された部分は一度だけ書き出し、読み戻しても共有されたままになる。
+     * 捕捉を持つクロージャや名簿にない関数を含むときは std::invalid_argument を投げる。
+     * C++ のスタック上にある評価途中の文脈は書き出せないので、評価の合間に呼び出すこと。
+     */
+    inline std::string checkpoint_encode(const expression &e, const checkpoint::registry &names = checkpoint::registry::standard())
+    {
+        return checkpoint::writer(names).write(e);
+    }
+
+    /**
+     * @brief checkpoint_encode で書き出したバイト列を式に読み戻す
+     * @param[in] data 書き出した結果
+     * @param[in] names 書き出したときと同じ名前で関数を載せた名簿
+     * @return 読み戻した式
+     * @detail 壊れたデータには std::runtime_error を、名簿にない名前には std::invalid_argument を投げる。
+     */
+    inline expression checkpoint_decode(const std::string &data, const checkpoint::registry &names = checkpoint::registry::standard())
+    {
+        return checkpoint::reader(names).read(reinterpret_cast<const unsigned char *>(data.data()), data.size());
+    }
+
+    /**
+     * @brief 式をチェックポイントのファイルに書き出す
+     * @param[in] path 書き出すファイルのパス
+     * @param[in] e 書き出す式
+     * @param[in] names ネイティブ表現を持たない関数の名簿
+     * @detail 一時ファイルに書いて同期してから置き換えるので、途中で落ちても前のチェックポイントが残る。
+     * 入出力に失敗したときは std::system_error を投げる。
+     */
+    inline void save_checkpoint(const char *path, const expression &e, const checkpoint::registry &names = checkpoint::registry::standard())
+    {
+        std::string data = checkpoint_encode(e, names);
+        std::string temporary = std::string(path) + ".tmp";
+        int fd;
+        while ((fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+            if (errno != EINTR) {
+                throw std::system_error(errno, std::generic_category(), temporary);
+            }
+        }
+        try {
+            io::output_buffer out(fd);
+            out.put(reinterpret_cast<const unsigned char *>(data.data()), data.size());
+            out.flush();
+            if (::fsync(fd) < 0) {
+                throw std::system_error(errno, std::generic_category(), temporary);
+            }
+        } catch (...) {
+            ::close(fd);
+            ::unlink(temporary.c_str());
+            throw;
+        }
+        if (::close(fd) < 0 || std::rename(temporary.c_str(), path) < 0) {
+            int error = errno;
+            ::unlink(temporary.c_str());
+            throw std::system_error(error, std::generic_category(), path);
+        }
+    }
+
+    /**
+     * @brief チェックポイントのファイルを読み戻す
+     * @param[in] path 読み込むファイルのパス
+     * @param[in] names 書き出したときと同じ名前で関数を載せた名簿
+     * @return 読み戻した式
+     * @detail 開けなかったときは std::system_error を投げる。
+     */
+    inline expression load_checkpoint(const char *path, const checkpoint::registry &names = checkpoint::registry::standard())
+    {
+        io::mapped_file file(path);
+        return checkpoint::reader(names).read(file.data(), file.size());
+    }
+
+    /**
+     * @brief 状態を繰り返し更新する長い計算を、チェックポイントを取りながら進める
+     * @param[in] path チェックポイントのファイルのパス
+     * @param[in] step 状態を一段進める関数
+     * @param[in] done 状態を受け取り、計算が終わっていればチャーチ真値を返す関数
+     * @param[in] initial 最初の状態
+     * @param[in] every チェックポイントを取る間隔。step を何回適用するごとか
+     * @param[in] names ネイティブ表現を持たない関数の名簿
+     * @return done が真を返した状態
+     * @detail path にチェックポイントがあれば initial の代わりにそこから再開する。
+     * 状態は step を適用するたびに弱頭部正規形まで評価し、every 回ごとと終わったときに path へ書き出す。
+     * プロセスが落ちても、やり直しは最後のチェックポイントからで済む。
+     */
+    inline expression iterate_with_checkpoints(const char *path, expression step, expression done, expression initial, std::size_t every = 1, const checkpoint::registry &names = checkpoint::registry::standard())
+    {
+        expression state = std::move(initial);
+        try {
+            state = load_checkpoint(path, names);
+        } catch (const std::system_error &e) {
+            if (e.code() != std::errc::no_such_file_or_directory) {
+                throw;
+            }
+        }
+        for (std::size_t n = 1; !native::decide(done(state)); ++n) {
+            expression next = step(state);
+            whnf(next);
+            state = std::move(next);
+            if (every && n % every == 0) {
+                save_checkpoint(path, state, names);
+            }
+        }
+        save_checkpoint(path, state, names);
+        return state;
+    }
+}
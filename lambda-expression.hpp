@@ -3,47 +3,1610 @@
  * @brief ラムダ計算を実装したヘッダオンリーライブラリです。
  */
 
+#pragma once
+
+#include "lambda-profile.hpp"
+#include "lambda-tally.hpp"
+#include "lambda-trace.hpp"
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <iterator>
-#include <numeric>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
 #include <vector>
 
-namespace lambda {
-    /**
-     * @brief ラムダ式の実装
-     */
-    class expression final : std::function<expression(expression)> {
-        using std::function<expression(expression)>::function;
-        /* デコード処理だけは pass_by_value を使ってもよい */
-        friend std::size_t church_decode(expression);
-        template <class OutputIterator>
-        friend void scott_decode(expression, OutputIterator);
+namespace lambda {
+    namespace native {
+        struct boolean;
+        struct constant;
+        struct numeral;
+        struct sum;
+        class pair;
+        struct list;
+        class pipeline;
+        class sequence;
+        struct fixpoint;
+        struct builtin;
+        struct partial;
+        struct constructor;
+    }
+
+    template <>
+    struct profile::is_native<native::boolean> : std::true_type {
+    };
+    template <>
+    struct profile::is_native<native::constant> : std::true_type {
+    };
+    template <>
+    struct profile::is_native<native::numeral> : std::true_type {
+    };
+    template <>
+    struct profile::is_native<native::sum> : std::true_type {
+    };
+    template <>
+    struct profile::is_native<native::pair> : std::true_type {
+    };
+    template <>
+    struct profile::is_native<native::list> : std::true_type {
+    };
+    template <>
+    struct profile::is_native<native::pipeline> : std::true_type {
+    };
+    template <>
+    struct profile::is_native<native::sequence> : std::true_type {
+    };
+    template <>
+    struct profile::is_native<native::fixpoint> : std::true_type {
+    };
+    template <>
+    struct profile::is_native<native::builtin> : std::true_type {
+    };
+    template <>
+    struct profile::is_native<native::partial> : std::true_type {
+    };
+
+    namespace native {
+        /**
+         * @brief 式の実装の種類
+         * @detail 式は作られたときに種類を覚えておく。適用や分解の箇所ではまずこれを比べ、
+         * 型情報による照合は種類が合ったときだけ行う。
+         */
+        enum class kind : std::uint8_t {
+            other, /**< 以下のいずれでもない */
+            thunk,
+            boolean,
+            constant,
+            numeral,
+            sum,
+            pair,
+            list,
+            pipeline,
+            sequence,
+            fixpoint,
+            builtin,
+            partial
+        };
+
+        /** 実装の型 T に対応する種類 */
+        template <class T>
+        struct kind_of : std::integral_constant<kind, kind::other> {
+        };
+        template <>
+        struct kind_of<boolean> : std::integral_constant<kind, kind::boolean> {
+        };
+        template <>
+        struct kind_of<constant> : std::integral_constant<kind, kind::constant> {
+        };
+        template <>
+        struct kind_of<numeral> : std::integral_constant<kind, kind::numeral> {
+        };
+        template <>
+        struct kind_of<sum> : std::integral_constant<kind, kind::sum> {
+        };
+        template <>
+        struct kind_of<pair> : std::integral_constant<kind, kind::pair> {
+        };
+        template <>
+        struct kind_of<list> : std::integral_constant<kind, kind::list> {
+        };
+        template <>
+        struct kind_of<pipeline> : std::integral_constant<kind, kind::pipeline> {
+        };
+        template <>
+        struct kind_of<sequence> : std::integral_constant<kind, kind::sequence> {
+        };
+        template <>
+        struct kind_of<fixpoint> : std::integral_constant<kind, kind::fixpoint> {
+        };
+        template <>
+        struct kind_of<builtin> : std::integral_constant<kind, kind::builtin> {
+        };
+        template <>
+        struct kind_of<partial> : std::integral_constant<kind, kind::partial> {
+        };
+
+        /** 組み込みのコンビネータの番号。combinators での並びと同じ */
+        enum class op : std::uint8_t {
+            Y,
+            I,
+            K,
+            S,
+            i,
+            succ,
+            pred,
+            add,
+            sub,
+            mult,
+            power,
+            is_zero,
+            leq,
+            eq,
+            min,
+            max,
+            quot,
+            rem,
+            cons,
+            car,
+            cdr,
+            is_empty,
+            length,
+            map,
+            foldl,
+            foldr,
+            append,
+            reverse,
+            nth,
+            take,
+            drop,
+            update,
+            filter
+        };
+
+        /** 組み込みのコンビネータの数 */
+        static constexpr std::size_t ops = static_cast<std::size_t>(op::filter) + 1;
+
+        /**
+         * @brief 組み込みのコンビネータの本体を実行する
+         * @param[in] code コンビネータの番号
+         * @param[in] args 本体が受け取る数だけの引数
+         * @return 評価結果
+         * @detail 本体は code による switch で選ぶので、呼び出しが関数ポインタを介さない。
+         */
+        expression invoke(op code, const expression *args);
+    }
+
+    namespace checkpoint {
+        struct access;
+    }
+
+    /**
+     * @brief 評価の進み具合を見張るフック
+     * @detail current に設定されている間、そのスレッドで行われる簡約の一段ごとに step が呼び出される。
+     * 評価を中断して別の仕事に切り替えるのに使う。
+     */
+    class step_hook {
+    public:
+        virtual ~step_hook() = default;
+
+        /** 関数適用を一段行う直前に呼び出される */
+        virtual void step() = 0;
+
+        /** ほかで評価中のサンクの結果を待つ間、繰り返し呼び出される */
+        virtual void wait() = 0;
+
+        /** 現在のスレッドで有効なフック。なければ nullptr */
+        inline static thread_local step_hook *current = nullptr;
+    };
+
+    /**
+     * @brief ラムダ式の実装
+     */
+    class expression final : std::function<expression(expression)> {
+#ifdef LAMBDA_PROFILE
+    public:
+        expression() = default;
+
+        /**
+         * @brief 関数からラムダ式を作る
+         * @param[in] f 関数
+         * @param[in] file 作った場所のファイル名。既定値のまま使うこと
+         * @param[in] line 作った場所の行番号。既定値のまま使うこと
+         * @detail ネイティブ表現でない関数には作った場所を添え、適用されるたびにその場所へ費用を計上する。
+         */
+        template <class F, class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, expression>>>
+        expression(F f, const char *file = __builtin_FILE(), unsigned line = __builtin_LINE())
+            : std::function<expression(expression)>(locate(std::move(f), file, line)), _kind(native::kind_of<F>::value)
+        {
+        }
+
+    private:
+        template <class F>
+        static auto locate(F f, const char *file, unsigned line)
+        {
+            if constexpr (profile::is_native<F>::value) {
+                return f;
+            } else {
+                return profile::located<F>{std::move(f), file, line};
+            }
+        }
+#else
+    public:
+        expression() = default;
+
+        /**
+         * @brief 関数からラムダ式を作る
+         * @param[in] f 関数
+         */
+        template <class F, class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, expression>>>
+        expression(F f)
+            : std::function<expression(expression)>(std::move(f)), _kind(native::kind_of<F>::value)
+        {
+        }
+#endif
+    public:
+        expression(const expression &) = default;
+        expression(expression &&) = default;
+
+        /* 代入元が代入先の持つ値の一部であっても壊れないよう、種類を先に読んでから置き換える */
+        expression &operator=(const expression &other)
+        {
+            native::kind kind = other._kind;
+            std::function<expression(expression)>::operator=(static_cast<const std::function<expression(expression)> &>(other));
+            _kind = kind;
+            return *this;
+        }
+
+        expression &operator=(expression &&other) noexcept
+        {
+            native::kind kind = other._kind;
+            std::function<expression(expression)>::operator=(static_cast<std::function<expression(expression)> &&>(other));
+            _kind = kind;
+            return *this;
+        }
+
+        /* デコード処理と末尾位置の適用だけは pass_by_value を使ってもよい */
+        friend std::size_t church_decode(expression);
+        template <class OutputIterator>
+        friend void scott_decode(expression, OutputIterator);
+        template <class... Args>
+        friend expression tail_call(expression, Args &&...);
+        friend const expression &whnf(const expression &);
+        template <class T>
+        friend const T *native_cast(const expression &);
+        template <class T>
+        friend const T *peek_cast(const expression &);
+        friend class native::pair;
+        friend struct native::constructor;
+        friend struct checkpoint::access;
+        friend std::string trace::describe(const std::type_info &);
+
+    private:
+        class thunk;
+
+        /** 実装の種類 */
+        native::kind _kind = native::kind::other;
+
+        /**
+         * @brief 実装を T として取り出す
+         * @return 実装が T であればそのポインタ、そうでなければ nullptr
+         * @detail 種類の決まっている型であれば、まず種類を比べて型情報の照合を省く。
+         */
+        template <class T>
+        const T *target() const noexcept
+        {
+            constexpr native::kind k = native::kind_of<T>::value;
+            if (k != native::kind::other && _kind != k) {
+                return nullptr;
+            }
+            return std::function<expression(expression)>::target<T>();
+        }
+
+        template <class T>
+        T *target() noexcept
+        {
+            return const_cast<T *>(static_cast<const expression *>(this)->target<T>());
+        }
+
+        /**
+         * @brief 評価済みの部分だけを辿ってネイティブ表現を取り出す
+         * @return T として評価済みであればそのポインタ、そうでなければ nullptr
+         * @detail 未評価の適用を評価することはない。
+         */
+        template <class T>
+        const T *peek() const;
+
+        /**
+         * @brief 組み込みのコンビネータの適用を、サンクを作らずにその場で済ませてよいか
+         * @param[in] code コンビネータの番号
+         * @param[in] x 最後の引数
+         * @return 本体が何も評価せずに済むなら true。I と K と cons、評価済みのネイティブ表現の自然数に対する succ, pred, is_zero、
+         * 評価済みのネイティブ表現のリストに対する car, cdr, is_empty がこれにあたる
+         */
+        static bool immediate(native::op code, const expression &x);
+
+        /** 簡約を一段行ったことをフックと記録に伝える */
+        void reduced() const
+        {
+            if (step_hook *hook = step_hook::current) {
+                hook->step();
+            }
+#ifdef LAMBDA_TRACE
+            trace::target().record(trace::kind::apply, &type());
+#endif
+        }
+
+        /**
+         * @brief 値呼びを行う
+         * @param[in] arg 引数
+         * @return 評価結果
+         */
+        expression pass_by_value(expression arg) const;
+
+        /**
+         * @brief 引数を順に値呼びで適用する
+         * @param[in] function 適用する関数
+         * @param[in] args 引数の並び
+         * @param[in] n 引数の数
+         * @return 評価結果
+         * @detail 組み込みのコンビネータに残りの引数が揃っていれば、途中の partial を作らずに本体を直接実行する。
+         */
+        static expression apply(expression function, const expression *args, std::size_t n);
+
+        /**
+         * @brief 名簿や記録の上での型
+         * @return 組み込みのコンビネータであればコンビネータごとの型、そうでなければ実装の型
+         */
+        const std::type_info &type() const;
+
+    public:
+        /**
+         * @brief 名前呼びを行う
+         * @param[in] arg 引数
+         * @return 評価結果
+         * @detail 適用は遅延され、最初に必要になったときに一度だけ評価される。
+         */
+        expression operator()(expression arg) const;
+    };
+
+    /**
+     * @brief 名前呼びによって遅延された関数適用
+     * @detail 最初に評価されたときの弱頭部正規形を共有されたセルに記録し、以降はそれを使い回す。
+     * 複数のスレッドから同時に評価されても適用は一度しか行われない。
+     */
+    class expression::thunk final {
+        friend struct checkpoint::access;
+
+    private:
+        enum state : int {
+            unevaluated,
+            evaluating,
+            awaited, /**< 評価中で、ほかのスレッドが結果を待っている */
+            ready
+        };
+
+        struct cell {
+            expression function;
+            expression argument;
+            expression value;
+            std::atomic<int> state = unevaluated;
+        };
+        std::shared_ptr<cell> _cell;
+
+        /**
+         * 結果を待つスレッドを眠らせる場所。セルごとに持つと重いので、アドレスで振り分けて共有する。
+         */
+        struct waiting_room {
+            std::mutex mutex;
+            std::condition_variable ready;
+        };
+
+        static waiting_room &room(const cell *c)
+        {
+            static waiting_room rooms[64];
+            return rooms[reinterpret_cast<std::uintptr_t>(c) / alignof(cell) % 64];
+        }
+
+        /**
+         * @brief 評価中の状態を抜け、待っているスレッドがあれば起こす
+         * @param[in] c セル
+         * @param[in] next 次の状態
+         */
+        static void leave(cell *c, int next)
+        {
+            if (c->state.exchange(next, std::memory_order_acq_rel) == awaited) {
+                waiting_room &r = room(c);
+                std::lock_guard<std::mutex> lock(r.mutex);
+                r.ready.notify_all();
+            }
+        }
+
+        const expression &force_slow() const
+        {
+            cell *c = _cell.get();
+#ifdef LAMBDA_TRACE
+            bool waited = false;
+#endif
+            for (;;) {
+                int s = unevaluated;
+                if (c->state.compare_exchange_strong(s, evaluating, std::memory_order_acquire)) {
+                    try {
+#ifdef LAMBDA_TRACE
+                        trace::target().record(trace::kind::force, &c->function.type());
+                        trace::nested depth;
+#endif
+                        c->value = c->function.pass_by_value(c->argument);
+                    } catch (...) {
+                        /* 評価が例外で抜けたら、次に必要になったときに改めて評価する */
+                        leave(c, unevaluated);
+                        throw;
+                    }
+                    /* 評価し終えた式は保持し続ける必要がない */
+                    c->function = c->argument = expression();
+                    leave(c, ready);
+                    return c->value;
+                }
+                if (s == ready) {
+                    return c->value;
+                }
+#ifdef LAMBDA_TRACE
+                if (!waited) {
+                    trace::target().record(trace::kind::wait, nullptr);
+                    waited = true;
+                }
+#endif
+                if (step_hook *hook = step_hook::current) {
+                    /* 評価しているのが同じスレッドの中断中の仕事かもしれないので、眠らずに順番を譲る */
+                    hook->wait();
+                    continue;
+                }
+                waiting_room &r = room(c);
+                std::unique_lock<std::mutex> lock(r.mutex);
+                s = evaluating;
+                c->state.compare_exchange_strong(s, awaited, std::memory_order_acquire);
+                r.ready.wait(lock, [c] {
+                    int s = c->state.load(std::memory_order_acquire);
+                    return s != evaluating && s != awaited;
+                });
+            }
+        }
+
+    public:
+        thunk(expression function, expression argument)
+            : _cell(std::make_shared<cell>())
+        {
+#ifdef LAMBDA_PROFILE
+            profile::allocated();
+#endif
+#ifdef LAMBDA_TALLY
+            tally::allocated();
+#endif
+#ifdef LAMBDA_TRACE
+            trace::target().record(trace::kind::allocate, &function.type(), sizeof(cell));
+#endif
+            _cell->function = std::move(function);
+            _cell->argument = std::move(argument);
+        }
+
+        /**
+         * @brief 弱頭部正規形まで評価する
+         * @return 評価結果
+         */
+        const expression &force() const
+        {
+            if (_cell->state.load(std::memory_order_acquire) == ready) {
+                return _cell->value;
+            }
+            return force_slow();
+        }
+
+        /**
+         * @brief 評価済みであれば評価結果を得る
+         * @return 評価結果へのポインタ。未評価であれば nullptr
+         */
+        const expression *evaluated() const
+        {
+            return _cell->state.load(std::memory_order_acquire) == ready ? &_cell->value : nullptr;
+        }
+
+        expression operator()(expression arg) const
+        {
+            return force().pass_by_value(arg);
+        }
+
+        /**
+         * @brief ほかから参照されていなければ、セルの中の式を取り出す
+         * @param[out] pending 取り出した式の追加先
+         * @detail 深い構造を再帰せずに解放するために使う。
+         */
+        void release(std::vector<expression> &pending)
+        {
+            if (_cell && _cell.use_count() == 1) {
+                pending.push_back(std::move(_cell->function));
+                pending.push_back(std::move(_cell->argument));
+                pending.push_back(std::move(_cell->value));
+            }
+        }
+
+        /**
+         * @brief ほかから参照されていない評価済みのサンクであれば、その値を返す
+         * @return 値。評価済みでないかほかから参照されていれば nullptr
+         * @detail 長い連鎖を再帰せずに解放するために使う。
+         */
+        expression *unique_value()
+        {
+            if (_cell && _cell.use_count() == 1 && _cell->state.load(std::memory_order_acquire) == ready) {
+                return &_cell->value;
+            }
+            return nullptr;
+        }
+    };
+
+    template <>
+    struct profile::is_native<expression::thunk> : std::true_type {
+    };
+    template <>
+    struct native::kind_of<expression::thunk> : std::integral_constant<native::kind, native::kind::thunk> {
+    };
+
+    /**
+     * @brief 組み込みのコンビネータが用いるネイティブ表現
+     * @detail いずれも純粋なラムダ式と同じように振る舞うが、エンジンがその正体を見分けられる。
+     */
+    namespace native {
+        /** チャーチブール値。λxy.x または λxy.y として振る舞う。 */
+        struct boolean {
+            bool value;
+            expression operator()(expression x) const;
+        };
+
+        /** 定数関数。λy.value として振る舞う。 */
+        struct constant {
+            expression value;
+            expression operator()(expression y) const
+            {
+                return value;
+            }
+        };
+
+        /** チャーチ数。λfx.f(f(...(f x))) として振る舞う。 */
+        struct numeral {
+            std::size_t value;
+            expression operator()(expression f) const
+            {
+                return [n = value, f](expression x) {
+                    for (std::size_t i = 0; i < n; ++i) {
+                        x = f(x);
+                    }
+                    return x;
+                };
+            }
+        };
+
+        /**
+         * @brief 評価済みの自然数に、まだ評価していない自然数を足したもの
+         * @detail succ や add の引数が未評価のとき、それを評価せずに弱頭部正規形を作るために使う。
+         * value は 1 以上で、terms は足す式を pair で並べたリスト。λfx.f(f(...(terms の合計 f x))) として振る舞い、
+         * terms は f を value 回適用した結果の中身が必要になったときに初めて評価する。
+         */
+        struct sum {
+            std::size_t value;
+            expression terms;
+
+            /** value と terms の合計を求める。ネイティブ表現でない数が混じっていれば、それを足す式を返す */
+            expression resolve() const
+            {
+                return total(value, terms);
+            }
+
+            expression operator()(expression f) const;
+
+        private:
+            static expression total(std::size_t value, const expression &terms);
+        };
+
+        /**
+         * @brief スコットエンコーディングによるリストのセル。λf.f first second として振る舞う。
+         * @detail 長く連なったセルを複製しても後続のセルまで複製されないよう、中身は共有する。
+         */
+        class pair {
+        private:
+            std::shared_ptr<std::array<expression, 2>> _cell;
+
+        public:
+            pair(expression first, expression second)
+                : _cell(std::make_shared<std::array<expression, 2>>(std::array<expression, 2>{std::move(first), std::move(second)}))
+            {
+            }
+
+            pair(const pair &) = default;
+            pair(pair &&) = default;
+            pair &operator=(const pair &) = default;
+            pair &operator=(pair &&) = default;
+
+            /**
+             * 長い連鎖を再帰的に解放してスタックを溢れさせないよう、
+             * ほかから参照されていない後続のセルは一つずつ手前に引き寄せてから解放する。
+             * 後続が評価済みのサンクに包まれていても、そのサンクがほかから参照されていなければ中を辿る。
+             */
+            ~pair()
+            {
+                while (_cell && _cell.use_count() == 1) {
+                    expression *tail = &(*_cell)[1];
+                    while (auto t = tail->target<expression::thunk>()) {
+                        tail = t->unique_value();
+                        if (!tail) {
+                            break;
+                        }
+                    }
+                    pair *next = tail ? tail->target<pair>() : nullptr;
+                    if (!next) {
+                        break;
+                    }
+                    auto rest = std::move(next->_cell);
+                    _cell = std::move(rest);
+                }
+            }
+
+            const expression &first() const
+            {
+                return (*_cell)[0];
+            }
+
+            const expression &second() const
+            {
+                return (*_cell)[1];
+            }
+
+            expression operator()(expression f) const;
+        };
+
+        /**
+         * @brief 配列に格納されたスコットエンコーディングによるリスト
+         * @detail [first, last) の範囲の要素を持つ。空リストもこれで表す。
+         */
+        struct list {
+            std::shared_ptr<const std::vector<expression>> items;
+            std::size_t first = 0;
+            std::size_t last = 0;
+
+            bool empty() const
+            {
+                return first == last;
+            }
+
+            expression operator()(expression f) const;
+        };
+
+        /**
+         * @brief ネイティブ表現のリストに map と filter を重ねたもの
+         * @detail 中間のリストを作らず、source の各要素に各段を順に施したリストとして振る舞う。
+         * 要素を先頭から辿るだけの処理は各段をその場で適用し、リストとして分解されたときに初めて一度だけ実体化する。
+         */
+        class pipeline {
+            friend struct checkpoint::access;
+
+        public:
+            /** map の段なら関数を、filter の段なら述語を持つ */
+            struct stage {
+                bool filter;
+                expression function;
+            };
+
+        private:
+            struct state {
+                list source;
+                std::vector<stage> stages;
+                list value;
+                std::atomic<bool> ready = false;
+                /** 実体化を一度だけ行うためのサンク */
+                expression materialized;
+            };
+            std::shared_ptr<state> _state;
+
+            template <class Visitor>
+            static void each(const state &s, Visitor visit);
+
+        public:
+            pipeline(list source, std::vector<stage> stages);
+
+            /**
+             * @brief 段を一つ継ぎ足す
+             * @param[in] next 継ぎ足す段
+             * @return 継ぎ足した結果
+             */
+            pipeline then(stage next) const;
+
+            /**
+             * @brief filter の段を含むか
+             * @return 含んでいれば true。含まなければ要素数は source と変わらない。
+             */
+            bool filters() const;
+
+            /**
+             * @brief 先頭の n 要素を除く
+             * @param[in] n 除く要素数。filter の段を含まないときだけ使える
+             * @return 除いた結果
+             */
+            pipeline drop(std::size_t n) const;
+
+            /** source の要素数 */
+            std::size_t source_size() const;
+
+            /**
+             * @brief 各段を施した要素を先頭から順に訪れる
+             * @param[in] visit 各要素に対して呼び出す関数
+             */
+            template <class Visitor>
+            void for_each(Visitor visit) const;
+
+            /**
+             * @brief 各段を施した結果をリストとして実体化する
+             * @return 実体化したリスト
+             */
+            const list &materialize() const;
+
+            expression operator()(expression f) const;
+        };
+
+        /**
+         * @brief 平衡二分木に格納されたスコットエンコーディングによるリスト
+         * @detail 永続的な AVL 木で、添字による参照と更新、連結、分割をいずれも O(log n) で行える。
+         * リストとして分解すると先頭要素と残りの列に分かれる。
+         */
+        class sequence {
+            friend struct checkpoint::access;
+
+        private:
+            struct node;
+            using tree = std::shared_ptr<const node>;
+            tree _root;
+
+            explicit sequence(tree root);
+            static std::size_t size(const tree &t);
+            static int height(const tree &t);
+            static tree make(tree left, expression value, tree right);
+            static tree rotate_left(const tree &t);
+            static tree rotate_right(const tree &t);
+            static tree join(tree left, expression value, tree right);
+            static tree join(tree left, tree right);
+            static tree build(const std::vector<expression> &items, std::size_t first, std::size_t last);
+            static void split(const tree &t, std::size_t i, tree &left, expression &value, tree &right);
+
+        public:
+            sequence() = default;
+
+            /**
+             * @brief 配列に並んだ要素から列を作る
+             * @param[in] items 要素の並び
+             * @return 作った列
+             */
+            static sequence from(const std::vector<expression> &items);
+
+            /** 要素数 */
+            std::size_t size() const;
+
+            bool empty() const;
+
+            /**
+             * @brief i 番目の要素
+             * @param[in] i 添字。size() 未満であること
+             * @return i 番目の要素
+             */
+            const expression &at(std::size_t i) const;
+
+            /**
+             * @brief i 番目の要素を置き換えた列
+             * @param[in] i 添字。size() 未満であること
+             * @param[in] x 新しい要素
+             * @return 置き換えた結果
+             */
+            sequence update(std::size_t i, expression x) const;
+
+            /**
+             * @brief 連結した列
+             * @param[in] other 後ろに連結する列
+             * @return 連結した結果
+             */
+            sequence concat(const sequence &other) const;
+
+            /** 先頭の n 要素 */
+            sequence take(std::size_t n) const;
+
+            /** 先頭の n 要素を除いた列 */
+            sequence drop(std::size_t n) const;
+
+            /**
+             * @brief 要素を先頭から順に訪れる
+             * @param[in] visit 各要素に対して呼び出す関数
+             */
+            template <class Visitor>
+            void for_each(Visitor visit) const;
+
+            expression operator()(expression f) const;
+        };
+
+        /**
+         * @brief 不動点コンビネータの結果 Y f への再帰的な参照。λx.f (Y f) x として振る舞う。
+         * @detail 自己適用 (λx.f (x x)) (λx.f (x x)) を展開する代わりに f を直接持ち、
+         * 再帰のたびに自己適用のサンクとクロージャを作らずに済ませる。
+         */
+        struct fixpoint {
+            expression function;
+            expression operator()(expression x) const;
+        };
+
+        /**
+         * @brief 組み込みのコンビネータ
+         * @detail 本体を持たず、番号だけで表す。何も捕捉しないので、複製してもメモリを確保しない。
+         * 本体が受け取る数の引数が揃うまでは partial を返す。
+         */
+        struct builtin {
+            op code;
+
+            /** 本体が受け取る引数の数 */
+            static std::size_t arity(op code)
+            {
+                static constexpr std::uint8_t arities[ops] = {
+                    1, 1, 1, 3, 1, 1, 1, 2, 2, 2, 2, 1, 2, 2, 2, 2, 2,
+                    2, 2, 1, 1, 1, 1, 2, 3, 3, 2, 1, 2, 2, 2, 3, 2};
+                return arities[static_cast<std::size_t>(code)];
+            }
+
+            /** combinators での名前 */
+            static const char *name(op code)
+            {
+                static constexpr const char *names[ops] = {
+                    "Y", "I", "K", "S", "i", "succ", "pred", "add", "sub", "mult", "power",
+                    "is_zero", "leq", "eq", "min", "max", "quot", "rem", "cons", "car", "cdr", "is_empty",
+                    "length", "map", "foldl", "foldr", "append", "reverse", "nth", "take", "drop", "update", "filter"};
+                return names[static_cast<std::size_t>(code)];
+            }
+
+            /**
+             * @brief コンビネータごとに異なる型
+             * @param[in] code コンビネータの番号
+             * @param[in] partial 引数を受け取る途中であれば true
+             * @return 名簿や記録の上で、実装の型の代わりに使う型
+             */
+            static const std::type_info &type(op code, bool partial);
+
+            expression operator()(expression x) const;
+        };
+
+        /**
+         * @brief 引数を受け取る途中の組み込みのコンビネータ。残りの引数を受け取ると code の本体を実行する。
+         * @detail 受け取った引数は args の先頭から count 個に並ぶ。
+         */
+        struct partial {
+            op code;
+            std::uint8_t count;
+            std::array<expression, 2> args;
+            expression operator()(expression x) const;
+        };
+
+        /** 組み込みのコンビネータを見分けるための型 */
+        template <op Code, bool Partial>
+        struct signature {
+        };
+
+        template <std::size_t... I>
+        inline const std::type_info &signature_type(op code, bool partial, std::index_sequence<I...>)
+        {
+            static const std::type_info *const types[2][ops] = {
+                {&typeid(signature<static_cast<op>(I), false>)...},
+                {&typeid(signature<static_cast<op>(I), true>)...}};
+            return *types[partial][static_cast<std::size_t>(code)];
+        }
+
+        inline const std::type_info &builtin::type(op code, bool partial)
+        {
+            return signature_type(code, partial, std::make_index_sequence<ops>());
+        }
+
+        inline expression builtin::operator()(expression x) const
+        {
+            if (arity(code) == 1) {
+                return invoke(code, &x);
+            }
+            return partial{code, 1, {std::move(x)}};
+        }
+
+        inline expression partial::operator()(expression x) const
+        {
+            if (count + 1u == builtin::arity(code)) {
+                if (count == 1) {
+                    const expression all[] = {args[0], std::move(x)};
+                    return invoke(code, all);
+                }
+                const expression all[] = {args[0], args[1], std::move(x)};
+                return invoke(code, all);
+            }
+            partial next = *this;
+            next.args[next.count++] = std::move(x);
+            return next;
+        }
+
+        inline expression boolean::operator()(expression x) const
+        {
+            if (value) {
+                return constant{x};
+            }
+            /* 偽の分岐は I そのものを返し、クロージャを確保しない */
+            return builtin{op::I};
+        }
+    }
+
+    template <class T>
+    inline const T *expression::peek() const
+    {
+        const expression *e = this;
+        for (const thunk *t; (t = e->target<thunk>());) {
+            if (!(e = t->evaluated())) {
+                return nullptr;
+            }
+        }
+        return e->target<T>();
+    }
+
+    inline expression expression::operator()(expression arg) const
+    {
+        const expression *e = this;
+        for (const thunk *t; (t = e->target<thunk>());) {
+            if (!(e = t->evaluated())) {
+                return thunk(*this, arg);
+            }
+        }
+        switch (e->_kind) {
+        case native::kind::boolean:
+            /* 値の分かっている真偽値による分岐は何も評価しないので、遅延させずにその場で選ぶ */
+            return (*e->target<native::boolean>())(arg);
+        case native::kind::constant:
+            return e->target<native::constant>()->value;
+        case native::kind::builtin: {
+            /* 引数が足りない組み込みのコンビネータの適用は、サンクを作らずにその場で引数を束ねる */
+            native::op code = e->target<native::builtin>()->code;
+            if (native::builtin::arity(code) > 1) {
+                return native::partial{code, 1, {std::move(arg)}};
+            }
+            /* 引数を評価せずに済む適用も、同じくその場で済ませる */
+            if (immediate(code, arg)) {
+                return native::invoke(code, &arg);
+            }
+            break;
+        }
+        case native::kind::partial: {
+            const native::partial &p = *e->target<native::partial>();
+            if (p.count + 1u < native::builtin::arity(p.code)) {
+                native::partial next = p;
+                next.args[next.count++] = std::move(arg);
+                return next;
+            }
+            if (immediate(p.code, arg)) {
+                return p(std::move(arg));
+            }
+            break;
+        }
+        case native::kind::pair:
+            if (arg.peek<native::boolean>()) {
+                return (*e->target<native::pair>())(arg);
+            }
+            break;
+        case native::kind::list:
+            if (arg.peek<native::boolean>()) {
+                return (*e->target<native::list>())(arg);
+            }
+            break;
+        case native::kind::sequence:
+            if (arg.peek<native::boolean>()) {
+                return (*e->target<native::sequence>())(arg);
+            }
+            break;
+        default:
+            break;
+        }
+        return thunk(*this, arg);
+    }
+
+    inline bool expression::immediate(native::op code, const expression &x)
+    {
+        switch (code) {
+        case native::op::I:
+        case native::op::K:
+        case native::op::cons:
+            return true;
+        case native::op::succ:
+        case native::op::pred:
+        case native::op::is_zero:
+            return x.peek<native::numeral>();
+        case native::op::car:
+        case native::op::cdr:
+        case native::op::is_empty:
+            return x.peek<native::pair>() || x.peek<native::list>() || x.peek<native::sequence>();
+        default:
+            return false;
+        }
+    }
+
+    inline expression expression::pass_by_value(expression arg) const
+    {
+        reduced();
+        /* 組み込みのコンビネータは std::function の呼び出しを介さずに実行する */
+        switch (_kind) {
+        case native::kind::builtin:
+            return (*target<native::builtin>())(std::move(arg));
+        case native::kind::partial:
+            return (*target<native::partial>())(std::move(arg));
+        default:
+            return std::function<expression(expression)>::operator()(arg);
+        }
+    }
+
+    inline const std::type_info &expression::type() const
+    {
+        switch (_kind) {
+        case native::kind::builtin:
+            return native::builtin::type(target<native::builtin>()->code, false);
+        case native::kind::partial:
+            return native::builtin::type(target<native::partial>()->code, true);
+        default:
+            return target_type();
+        }
+    }
+
+    inline expression expression::apply(expression function, const expression *args, std::size_t n)
+    {
+        while (n) {
+            std::size_t used = 0;
+            if (function._kind == native::kind::builtin) {
+                native::op code = function.target<native::builtin>()->code;
+                if (std::size_t arity = native::builtin::arity(code); arity > 1 && arity <= n) {
+                    for (std::size_t i = 0; i < arity; ++i) {
+                        function.reduced();
+                    }
+                    function = native::invoke(code, args);
+                    used = arity;
+                }
+            } else if (function._kind == native::kind::partial) {
+                const native::partial &p = *function.target<native::partial>();
+                if (std::size_t rest = native::builtin::arity(p.code) - p.count; rest > 1 && rest <= n) {
+                    /* partial が受け取れる引数は高々二つなので、残りも高々二つ */
+                    const expression all[] = {p.args[0], args[0], args[1]};
+                    for (std::size_t i = 0; i < rest; ++i) {
+                        function.reduced();
+                    }
+                    function = native::invoke(p.code, all);
+                    used = rest;
+                }
+            }
+            if (!used) {
+                function = function.pass_by_value(args[0]);
+                used = 1;
+            }
+            args += used;
+            n -= used;
+        }
+        return function;
+    }
+
+    /**
+     * @brief 弱頭部正規形まで評価する
+     * @param[in] e 評価するラムダ式
+     * @return 評価結果
+     * @detail 得られた参照は e が生きている間だけ有効である。
+     */
+    inline const expression &whnf(const expression &e)
+    {
+        const expression *p = &e;
+        while (auto t = p->target<expression::thunk>()) {
+            p = &t->force();
+        }
+        return *p;
+    }
+
+    const expression &whnf(const expression &&) = delete;
+
+    /**
+     * @brief 弱頭部正規形まで評価し、ネイティブ表現を取り出す
+     * @param[in] e 評価するラムダ式
+     * @return e が T として表現されていればそのポインタ、そうでなければ nullptr
+     * @detail 得られたポインタは e が生きている間だけ有効である。
+     */
+    template <class T>
+    inline const T *native_cast(const expression &e)
+    {
+        return whnf(e).target<T>();
+    }
+
+    template <class T>
+    const T *native_cast(const expression &&) = delete;
+
+    /**
+     * @brief 評価済みの部分だけを辿り、ネイティブ表現を取り出す
+     * @param[in] e ラムダ式
+     * @return e が T として評価済みであればそのポインタ、そうでなければ nullptr
+     * @detail native_cast と違い、未評価の適用を評価しない。
+     */
+    template <class T>
+    inline const T *peek_cast(const expression &e)
+    {
+        return e.peek<T>();
+    }
+
+    template <class T>
+    const T *peek_cast(const expression &&) = delete;
+
+    /**
+     * @brief 関数本体の末尾で適用を行う
+     * @param[in] function 適用する関数
+     * @param[in] args 順に適用する引数
+     * @return 評価結果
+     * @detail 関数本体の戻り値は呼び出し元ですぐに適用されるため、末尾位置にある適用の連鎖が
+     * 外へ逃げ出すことはない。そのような中間の適用をヒープ上のサンクとして確保せず、その場で評価する。
+     * 組み込みのコンビネータに引数が揃っていれば、その本体を直接実行する。
+     * 引数そのものはこれまでどおり名前呼びで作ること。
+     */
+    template <class... Args>
+    inline expression tail_call(expression function, Args &&...args)
+    {
+        if constexpr (sizeof...(Args) == 0) {
+            return function;
+        } else if constexpr (sizeof...(Args) == 1) {
+            return function.pass_by_value(std::forward<Args>(args)...);
+        } else {
+            const expression all[] = {expression(std::forward<Args>(args))...};
+            return expression::apply(std::move(function), all, sizeof...(Args));
+        }
+    }
+
+    namespace native {
+        inline expression pair::operator()(expression f) const
+        {
+            /* セレクタとして真偽値を渡されたら、適用を二段重ねずに選んだ方を返す */
+            if (auto b = native_cast<boolean>(f)) {
+                return b->value ? first() : second();
+            }
+            return tail_call(f, first(), second());
+        }
+
+        inline expression fixpoint::operator()(expression x) const
+        {
+            return tail_call(function, *this, x);
+        }
+
+        inline expression sum::operator()(expression f) const
+        {
+            return [n = value, terms = terms, f](expression x) {
+                tally::scope counting(tally::succ, false);
+                /* クロージャを適用した式はサンクになるので、足した式の評価を必要になるまで遅らせられる */
+                expression y = expression([terms, f, x](expression) {
+                    return tail_call(total(0, terms), f, x);
+                })(builtin{op::I});
+                for (std::size_t i = 0; i < n; ++i) {
+                    y = f(y);
+                }
+                return y;
+            };
+        }
+
+        inline expression list::operator()(expression f) const
+        {
+            if (empty()) {
+                return boolean{true};
+            }
+            if (auto b = native_cast<boolean>(f)) {
+                return b->value ? (*items)[first] : expression(list{items, first + 1, last});
+            }
+            return tail_call(f, (*items)[first], list{items, first + 1, last});
+        }
+
+        /**
+         * @brief ネイティブ表現のリストを先頭から最大 n 要素読み飛ばす
+         * @param[in,out] l 読み飛ばすリスト。読み飛ばした後の残りが入る
+         * @param[in] n 読み飛ばす要素数の上限
+         * @return 実際に読み飛ばした要素数
+         * @detail 空リストかネイティブ表現でないセルに行き当たるとそこで止まる。
+         */
+        inline std::size_t skip(expression &l, std::size_t n)
+        {
+            std::size_t skipped = 0;
+            while (skipped < n) {
+                if (auto p = native_cast<pair>(l)) {
+                    l = p->second();
+                    ++skipped;
+                } else if (auto v = native_cast<list>(l); v && !v->empty()) {
+                    std::size_t k = std::min(n - skipped, v->last - v->first);
+                    l = list{v->items, v->first + k, v->last};
+                    skipped += k;
+                } else if (auto q = native_cast<sequence>(l); q && !q->empty()) {
+                    std::size_t k = std::min(n - skipped, q->size());
+                    l = k == q->size() ? expression(list{}) : expression(q->drop(k));
+                    skipped += k;
+                } else if (auto q = native_cast<pipeline>(l)) {
+                    if (q->filters()) {
+                        l = q->materialize();
+                    } else if (std::size_t k = std::min(n - skipped, q->source_size()); k < q->source_size()) {
+                        l = q->drop(k);
+                        skipped += k;
+                    } else {
+                        l = list{};
+                        skipped += k;
+                    }
+                } else {
+                    break;
+                }
+            }
+            return skipped;
+        }
+
+        /**
+         * @brief ネイティブ表現のリストの要素を先頭から順に訪れる
+         * @param[in,out] l 訪れるリスト。訪れ終えた後の残りが入る
+         * @param[in] visit 各要素に対して呼び出す関数
+         * @return 空リストまで辿り着いたら true、ネイティブ表現でないセルで止まったら false
+         */
+        template <class Visitor>
+        inline bool walk(expression &l, Visitor visit)
+        {
+            for (;;) {
+                if (auto p = native_cast<pair>(l)) {
+                    visit(p->first());
+                    l = p->second();
+                } else if (auto v = native_cast<list>(l)) {
+                    for (std::size_t i = v->first; i < v->last; ++i) {
+                        visit((*v->items)[i]);
+                    }
+                    l = list{};
+                    return true;
+                } else if (auto q = native_cast<pipeline>(l)) {
+                    q->for_each(visit);
+                    l = list{};
+                    return true;
+                } else if (auto q = native_cast<sequence>(l)) {
+                    q->for_each(visit);
+                    l = list{};
+                    return true;
+                } else {
+                    return false;
+                }
+            }
+        }
+
+        /**
+         * @brief チャーチブール値を C++ の真偽値に直す
+         * @param[in] b チャーチブール値
+         * @return デコード結果
+         */
+        inline bool decide(const expression &b)
+        {
+            if (auto v = native_cast<boolean>(b)) {
+                return v->value;
+            }
+            expression selected = tail_call(b, boolean{true}, boolean{false});
+            auto v = native_cast<boolean>(selected);
+            return v && v->value;
+        }
+
+        inline pipeline::pipeline(list source, std::vector<stage> stages)
+            : _state(std::make_shared<state>())
+        {
+            _state->source = std::move(source);
+            _state->stages = std::move(stages);
+            _state->materialized = expression([s = _state.get()](expression) -> expression {
+                auto items = std::make_shared<std::vector<expression>>();
+                each(*s, [&items](const expression &x) { items->push_back(x); });
+                s->value = list{items, 0, items->size()};
+                s->ready.store(true, std::memory_order_release);
+                return s->value;
+            })(expression());
+        }
+
+        inline pipeline pipeline::then(stage next) const
+        {
+            std::vector<stage> stages = _state->stages;
+            stages.push_back(std::move(next));
+            return pipeline(_state->source, std::move(stages));
+        }
+
+        inline bool pipeline::filters() const
+        {
+            return std::any_of(_state->stages.begin(), _state->stages.end(), [](const stage &s) {
+                return s.filter;
+            });
+        }
+
+        inline pipeline pipeline::drop(std::size_t n) const
+        {
+            const list &source = _state->source;
+            return pipeline(list{source.items, source.first + std::min(n, source.last - source.first), source.last}, _state->stages);
+        }
+
+        inline std::size_t pipeline::source_size() const
+        {
+            return _state->source.last - _state->source.first;
+        }
+
+        template <class Visitor>
+        inline void pipeline::each(const state &s, Visitor visit)
+        {
+            if (s.ready.load(std::memory_order_acquire)) {
+                const list &value = s.value;
+                for (std::size_t i = value.first; i < value.last; ++i) {
+                    visit((*value.items)[i]);
+                }
+                return;
+            }
+            const list &source = s.source;
+            for (std::size_t i = source.first; i < source.last; ++i) {
+                expression x = (*source.items)[i];
+                bool kept = std::all_of(s.stages.begin(), s.stages.end(), [&x](const stage &t) {
+                    if (t.filter) {
+                        return decide(t.function(x));
+                    }
+                    x = t.function(x);
+                    return true;
+                });
+                if (kept) {
+                    visit(x);
+                }
+            }
+        }
+
+        template <class Visitor>
+        inline void pipeline::for_each(Visitor visit) const
+        {
+            each(*_state, visit);
+        }
+
+        inline const list &pipeline::materialize() const
+        {
+            return *native_cast<list>(_state->materialized);
+        }
+
+        inline expression pipeline::operator()(expression f) const
+        {
+            return materialize()(f);
+        }
+
+        /**
+         * @brief 配列に格納されたリストとして取り出す
+         * @param[in] l 取り出すリスト
+         * @return 配列に格納されたリストへのポインタ。そう表現できなければ nullptr
+         * @detail pipeline はここで実体化される。得られたポインタは l が生きている間だけ有効である。
+         */
+        inline const list *list_cast(const expression &l)
+        {
+            if (auto v = native_cast<list>(l)) {
+                return v;
+            }
+            if (auto q = native_cast<pipeline>(l)) {
+                return &q->materialize();
+            }
+            return nullptr;
+        }
+
+        const list *list_cast(const expression &&) = delete;
+
+        struct sequence::node {
+            expression value;
+            tree left;
+            tree right;
+            std::size_t size;
+            int height;
+        };
+
+        inline sequence::sequence(tree root)
+            : _root(std::move(root))
+        {
+        }
+
+        inline std::size_t sequence::size(const tree &t)
+        {
+            return t ? t->size : 0;
+        }
+
+        inline int sequence::height(const tree &t)
+        {
+            return t ? t->height : 0;
+        }
+
+        inline sequence::tree sequence::make(tree left, expression value, tree right)
+        {
+            std::size_t n = size(left) + size(right) + 1;
+            int h = std::max(height(left), height(right)) + 1;
+            return std::make_shared<const node>(node{std::move(value), std::move(left), std::move(right), n, h});
+        }
+
+        inline sequence::tree sequence::rotate_left(const tree &t)
+        {
+            const tree &r = t->right;
+            return make(make(t->left, t->value, r->left), r->value, r->right);
+        }
+
+        inline sequence::tree sequence::rotate_right(const tree &t)
+        {
+            const tree &l = t->left;
+            return make(l->left, l->value, make(l->right, t->value, t->right));
+        }
+
+        inline sequence::tree sequence::join(tree left, expression value, tree right)
+        {
+            if (height(left) > height(right) + 1) {
+                tree joined = join(left->right, std::move(value), std::move(right));
+                if (height(joined) <= height(left->left) + 1) {
+                    return make(left->left, left->value, std::move(joined));
+                }
+                if (height(joined->left) > height(joined->right)) {
+                    joined = rotate_right(joined);
+                }
+                return rotate_left(make(left->left, left->value, std::move(joined)));
+            }
+            if (height(right) > height(left) + 1) {
+                tree joined = join(std::move(left), std::move(value), right->left);
+                if (height(joined) <= height(right->right) + 1) {
+                    return make(std::move(joined), right->value, right->right);
+                }
+                if (height(joined->right) > height(joined->left)) {
+                    joined = rotate_left(joined);
+                }
+                return rotate_right(make(std::move(joined), right->value, right->right));
+            }
+            return make(std::move(left), std::move(value), std::move(right));
+        }
+
+        inline sequence::tree sequence::join(tree left, tree right)
+        {
+            if (!left) {
+                return right;
+            }
+            if (!right) {
+                return left;
+            }
+            tree rest, empty;
+            expression first;
+            split(right, 0, empty, first, rest);
+            return join(std::move(left), std::move(first), std::move(rest));
+        }
+
+        inline sequence::tree sequence::build(const std::vector<expression> &items, std::size_t first, std::size_t last)
+        {
+            if (first == last) {
+                return nullptr;
+            }
+            std::size_t middle = first + (last - first) / 2;
+            return make(build(items, first, middle), items[middle], build(items, middle + 1, last));
+        }
+
+        inline void sequence::split(const tree &t, std::size_t i, tree &left, expression &value, tree &right)
+        {
+            std::size_t n = size(t->left);
+            if (i < n) {
+                split(t->left, i, left, value, right);
+                right = join(std::move(right), t->value, t->right);
+            } else if (i == n) {
+                left = t->left;
+                value = t->value;
+                right = t->right;
+            } else {
+                split(t->right, i - n - 1, left, value, right);
+                left = join(t->left, t->value, std::move(left));
+            }
+        }
+
+        inline sequence sequence::from(const std::vector<expression> &items)
+        {
+            return sequence(build(items, 0, items.size()));
+        }
 
-    private:
-        /**
-         * @brief 値呼びを行う
-         * @param[in] arg 引数
-         * @return 評価結果
-         */
-        expression pass_by_value(expression arg) const
+        inline std::size_t sequence::size() const
         {
-            return std::function<expression(expression)>::operator()(arg);
+            return size(_root);
+        }
+
+        inline bool sequence::empty() const
+        {
+            return !_root;
+        }
+
+        inline const expression &sequence::at(std::size_t i) const
+        {
+            const node *t = _root.get();
+            for (std::size_t n; i != (n = size(t->left));) {
+                if (i < n) {
+                    t = t->left.get();
+                } else {
+                    i -= n + 1;
+                    t = t->right.get();
+                }
+            }
+            return t->value;
+        }
+
+        inline sequence sequence::update(std::size_t i, expression x) const
+        {
+            tree left, right;
+            expression old;
+            split(_root, i, left, old, right);
+            return sequence(join(std::move(left), std::move(x), std::move(right)));
+        }
+
+        inline sequence sequence::concat(const sequence &other) const
+        {
+            return sequence(join(_root, other._root));
+        }
+
+        inline sequence sequence::take(std::size_t n) const
+        {
+            if (n >= size()) {
+                return *this;
+            }
+            tree left, right;
+            expression value;
+            split(_root, n, left, value, right);
+            return sequence(std::move(left));
+        }
+
+        inline sequence sequence::drop(std::size_t n) const
+        {
+            if (n >= size()) {
+                return sequence();
+            }
+            tree left, right;
+            expression value;
+            split(_root, n, left, value, right);
+            return sequence(join(nullptr, std::move(value), std::move(right)));
+        }
+
+        template <class Visitor>
+        inline void sequence::for_each(Visitor visit) const
+        {
+            std::vector<const node *> path;
+            for (const node *t = _root.get(); t || !path.empty();) {
+                if (t) {
+                    path.push_back(t);
+                    t = t->left.get();
+                } else {
+                    t = path.back();
+                    path.pop_back();
+                    visit(t->value);
+                    t = t->right.get();
+                }
+            }
+        }
+
+        inline expression sequence::operator()(expression f) const
+        {
+            if (empty()) {
+                return boolean{true};
+            }
+            if (auto b = native_cast<boolean>(f)) {
+                return b->value ? at(0) : expression(drop(1));
+            }
+            return tail_call(f, at(0), drop(1));
         }
 
-    public:
         /**
-         * @brief 名前呼びを行う
-         * @param[in] arg 引数
-         * @return 評価結果
+         * @brief 平衡二分木に格納された列を配列に格納されたリストに直す
+         * @param[in] q 直す列
+         * @return 直した結果
          */
-        expression operator()(expression arg) const
+        inline list flatten(const sequence &q)
         {
-            return [arg, *this](expression _) {
-                return pass_by_value(arg).pass_by_value(_);
-            };
+            auto items = std::make_shared<std::vector<expression>>();
+            items->reserve(q.size());
+            q.for_each([&items](const expression &x) { items->push_back(x); });
+            return list{items, 0, items->size()};
         }
-    };
+    }
 
     /**
      * @brief 自然数をチャーチエンコーディングする
@@ -52,14 +1615,7 @@ namespace lambda {
      */
     inline expression church_encode(std::size_t n)
     {
-        return [n](expression f) {
-            return [n, f](expression x) {
-                for (std::size_t i = 0; i < n; ++i) {
-                    x = f(x);
-                }
-                return x;
-            };
-        };
+        return native::numeral{n};
     }
 
     /**
@@ -67,157 +1623,824 @@ namespace lambda {
      */
     namespace combinators {
         /** 真値  */
-        static inline const expression truth = [](expression x) {
-            return [x](expression y) {
-                return x;
-            };
-        };
+        static inline const expression truth = native::boolean{true};
 
         /** 偽値 */
-        static inline const expression falsity = [](expression x) {
-            return [](expression y) {
-                return y;
-            };
-        };
+        static inline const expression falsity = native::boolean{false};
 
         /** Y コンビネータ。不動点コンビネータとして使用できる。 */
-        static inline const expression Y = [](expression f) {
-            return [f](expression x) {
-                return f(x(x));
-            }([f](expression x) {
-                return f(x(x));
-            });
-        };
+        static inline const expression Y = native::builtin{native::op::Y};
 
         /** SKI コンビネータの I */
-        static inline const expression I = [](expression x) {
-            return x;
-        };
+        static inline const expression I = native::builtin{native::op::I};
 
         /** SKI コンビネータの K */
-        static inline const expression K = [](expression x) {
-            return [x](expression y) {
-                return x;
-            };
-        };
+        static inline const expression K = native::builtin{native::op::K};
 
         /** SKI コンビネータの S */
-        static inline const expression S = [](expression x) {
-            return [x](expression y) {
-                return [x, y](expression z) {
-                    return x(z)(y(z));
-                };
-            };
-        };
+        static inline const expression S = native::builtin{native::op::S};
 
         /** iota コンビネータ */
-        static inline const expression i = [](expression f) {
-            return f(S)(K);
-        };
+        static inline const expression i = native::builtin{native::op::i};
 
         /** チャーチエンコーディングされた自然数の後者関数 */
-        static inline const expression succ = [](expression n) {
-            return [n](expression f) {
-                return [n, f](expression x) {
-                    return f(n(f)(x));
-                };
-            };
-        };
+        static inline const expression succ = native::builtin{native::op::succ};
 
         /** チャーチエンコーディングされた自然数の前者関数 */
-        static inline const expression pred = [](expression n) {
-            return [n](expression f) {
-                return [n, f](expression x) {
-                    return n(
-                        [f](expression g) {
-                            return [f, g](expression h) {
-                                return h(g(f));
-                            };
-                        })([x](expression y) {
-                        return x;
-                    })([](expression y) {
-                        return y;
-                    });
-                };
-            };
-        };
+        static inline const expression pred = native::builtin{native::op::pred};
 
         /** チャーチエンコーディングされた自然数の加算 */
-        static inline const expression add = [](expression n) {
-            return [n](expression m) {
-                return n(succ)(m);
-            };
-        };
+        static inline const expression add = native::builtin{native::op::add};
 
         /** チャーチエンコーディングされた自然数の減算 */
-        static inline const expression sub = [](expression n) {
-            return [n](expression m) {
-                return m(pred)(n);
-            };
-        };
+        static inline const expression sub = native::builtin{native::op::sub};
 
         /** チャーチエンコーディングされた自然数の乗算 */
-        static inline const expression mult = [](expression n) {
-            return [n](expression m) {
-                return n(add(m))(church_encode(0));
-            };
-        };
+        static inline const expression mult = native::builtin{native::op::mult};
+
+        /** チャーチエンコーディングされた自然数の冪乗。power(n)(m) は n の m 乗を表す。 */
+        static inline const expression power = native::builtin{native::op::power};
 
         /** チャーチエンコーディングされた自然数が 0 と等しいか */
-        static inline const expression is_zero = [](expression n) {
-            return n(
-                [](expression x) {
-                    return falsity;
-                })(truth);
-        };
+        static inline const expression is_zero = native::builtin{native::op::is_zero};
+
+        /** チャーチエンコーディングされた自然数について n <= m であるか */
+        static inline const expression leq = native::builtin{native::op::leq};
+
+        /** チャーチエンコーディングされた自然数が等しいか */
+        static inline const expression eq = native::builtin{native::op::eq};
+
+        /** チャーチエンコーディングされた自然数の小さい方 */
+        static inline const expression min = native::builtin{native::op::min};
+
+        /** チャーチエンコーディングされた自然数の大きい方 */
+        static inline const expression max = native::builtin{native::op::max};
+
+        /** チャーチエンコーディングされた自然数の除算。0 で割った結果は 0 とする。 */
+        static inline const expression quot = native::builtin{native::op::quot};
+
+        /** チャーチエンコーディングされた自然数の剰余。0 で割った余りは n とする。 */
+        static inline const expression rem = native::builtin{native::op::rem};
 
         /** スコットエンコーディングによるリストを構築する  */
-        static inline const expression cons = [](expression a) {
-            return [a](expression b) {
-                return [a, b](expression f) {
-                    return f(a)(b);
-                };
-            };
-        };
+        static inline const expression cons = native::builtin{native::op::cons};
 
         /** スコットエンコーディングによるリストの先頭要素 */
-        static inline const expression car = [](expression p) {
-            return p(
-                [](expression x) {
-                    return [x](expression y) {
-                        return x;
-                    };
-                });
-        };
+        static inline const expression car = native::builtin{native::op::car};
 
         /** スコットエンコーディングによるリストの先頭要素を除いたリスト */
-        static inline const expression cdr = [](expression p) {
-            return p(
-                [](expression x) {
-                    return [](expression y) {
-                        return y;
-                    };
-                });
-        };
+        static inline const expression cdr = native::builtin{native::op::cdr};
 
         /** スコットエンコーディングによる空リスト */
-        static inline const expression empty_list = [](expression f) {
-            return [](expression x) {
-                return [x](expression y) {
-                    return x;
-                };
-            };
-        };
+        static inline const expression empty_list = native::list{};
 
         /** スコットエンコーディングによるリストが空であるか */
-        static inline const expression is_empty = [](expression l) {
-            return l(
-                [](expression x) {
-                    return [](expression y) {
-                        return falsity;
+        static inline const expression is_empty = native::builtin{native::op::is_empty};
+
+        /** スコットエンコーディングによるリストの長さ */
+        static inline const expression length = native::builtin{native::op::length};
+
+        /** スコットエンコーディングによるリストの各要素に関数を適用する */
+        static inline const expression map = native::builtin{native::op::map};
+
+        /**
+         * スコットエンコーディングによるリストの左畳み込み。foldl(f)(z)(l) は f(...f(f(z)(x1))(x2)...)(xn) を表す。
+         * ネイティブ表現のリストを辿る間は、サンクの長い連鎖を作らないよう累積値を一段ごとに弱頭部正規形まで評価する。
+         */
+        static inline const expression foldl = native::builtin{native::op::foldl};
+
+        /** スコットエンコーディングによるリストの右畳み込み。foldr(f)(z)(l) は f(x1)(f(x2)(...f(xn)(z)...)) を表す。 */
+        static inline const expression foldr = native::builtin{native::op::foldr};
+
+        /** スコットエンコーディングによるリストの連結 */
+        static inline const expression append = native::builtin{native::op::append};
+
+        /** スコットエンコーディングによるリストを逆順にする */
+        static inline const expression reverse = native::builtin{native::op::reverse};
+
+        /** スコットエンコーディングによるリストの n 番目 (0 始まり) の要素 */
+        static inline const expression nth = native::builtin{native::op::nth};
+
+        /** スコットエンコーディングによるリストの先頭 n 要素 */
+        static inline const expression take = native::builtin{native::op::take};
+
+        /** スコットエンコーディングによるリストの先頭 n 要素を除いたリスト */
+        static inline const expression drop = native::builtin{native::op::drop};
+
+        /** スコットエンコーディングによるリストの n 番目 (0 始まり) の要素を x に置き換えたリスト */
+        static inline const expression update = native::builtin{native::op::update};
+
+        /** スコットエンコーディングによるリストのうち、述語 p を満たす要素だけを残したリスト */
+        static inline const expression filter = native::builtin{native::op::filter};
+    }
+
+    namespace native {
+        /**
+         * @brief 組み込みのコンビネータの本体
+         * @detail 引数は受け取った順に args[0], args[1], ... に並ぶ。
+         */
+        namespace builtins {
+            using namespace combinators;
+
+            template <op Code>
+            expression body(const expression *args);
+
+            template <>
+            inline expression body<op::Y>(const expression *args)
+            {
+                const expression &f = args[0];
+                return tail_call(f, fixpoint{f});
+            }
+
+            template <>
+            inline expression body<op::I>(const expression *args)
+            {
+                return args[0];
+            }
+
+            template <>
+            inline expression body<op::K>(const expression *args)
+            {
+                return constant{args[0]};
+            }
+
+            template <>
+            inline expression body<op::S>(const expression *args)
+            {
+                const expression &f = args[0], &g = args[1], &z = args[2];
+                return tail_call(f, z, g(z));
+            }
+
+            template <>
+            inline expression body<op::i>(const expression *args)
+            {
+                return tail_call(args[0], S, K);
+            }
+
+            template <>
+            inline expression body<op::succ>(const expression *args)
+            {
+                const expression &n = args[0];
+                /* 純粋な定義は n を評価せずに弱頭部正規形になるので、評価済みでなければ sum に包んで後回しにする */
+                if (auto k = peek_cast<numeral>(n)) {
+                    return church_encode(k->value + 1);
+                }
+                if (auto s = peek_cast<sum>(n)) {
+                    return sum{s->value + 1, s->terms};
+                }
+                return sum{1, pair{n, list{}}};
+            }
+
+            template <>
+            inline expression body<op::pred>(const expression *args)
+            {
+                const expression &n = args[0];
+                if (auto k = peek_cast<numeral>(n)) {
+                    return church_encode(k->value ? k->value - 1 : 0);
+                }
+                return [n](expression f) {
+                    tally::scope counting(tally::pred, false);
+                    return [n, f](expression x) {
+                        tally::scope counting(tally::pred, false);
+                        return tail_call(
+                            n,
+                            [f](expression g) {
+                                return [f, g](expression h) {
+                                    tally::scope counting(tally::pred, false);
+                                    return tail_call(h, g(f));
+                                };
+                            },
+                            [x](expression y) {
+                                return x;
+                            },
+                            I);
                     };
-                });
-        };
+                };
+            }
+
+            template <>
+            inline expression body<op::add>(const expression *args)
+            {
+                const expression &n = args[0], &m = args[1];
+                /* 純粋な定義が最初に評価する n だけを評価し、m は評価せずに sum として覚えておく */
+                if (auto a = native_cast<numeral>(n)) {
+                    if (auto b = peek_cast<numeral>(m)) {
+                        return church_encode(a->value + b->value);
+                    }
+                    if (a->value == 0) {
+                        return m;
+                    }
+                    if (auto t = peek_cast<sum>(m)) {
+                        return sum{a->value + t->value, t->terms};
+                    }
+                    return sum{a->value, pair{m, list{}}};
+                }
+                if (auto s = native_cast<sum>(n)) {
+                    if (auto b = peek_cast<numeral>(m)) {
+                        return sum{s->value + b->value, s->terms};
+                    }
+                    return sum{s->value, pair{m, s->terms}};
+                }
+                return tail_call(n, succ, m);
+            }
+
+            template <>
+            inline expression body<op::sub>(const expression *args)
+            {
+                const expression &n = args[0], &m = args[1];
+                if (auto b = native_cast<numeral>(m)) {
+                    if (auto a = peek_cast<numeral>(n)) {
+                        return church_encode(a->value > b->value ? a->value - b->value : 0);
+                    }
+                }
+                return tail_call(m, pred, n);
+            }
+
+            template <>
+            inline expression body<op::mult>(const expression *args)
+            {
+                const expression &n = args[0], &m = args[1];
+                if (auto a = native_cast<numeral>(n)) {
+                    if (a->value == 0) {
+                        return church_encode(0);
+                    }
+                    if (auto b = native_cast<numeral>(m)) {
+                        return church_encode(a->value * b->value);
+                    }
+                }
+                return tail_call(n, add(m), church_encode(0));
+            }
+
+            template <>
+            inline expression body<op::power>(const expression *args)
+            {
+                const expression &n = args[0], &m = args[1];
+                if (auto b = native_cast<numeral>(m)) {
+                    if (b->value == 0) {
+                        return church_encode(1);
+                    }
+                    if (auto a = native_cast<numeral>(n)) {
+                        std::size_t base = a->value, exponent = b->value, power = 1;
+                        for (; exponent; exponent >>= 1, base *= base) {
+                            if (exponent & 1) {
+                                power *= base;
+                            }
+                        }
+                        return church_encode(power);
+                    }
+                }
+                return tail_call(m, mult(n), church_encode(1));
+            }
+
+            template <>
+            inline expression body<op::is_zero>(const expression *args)
+            {
+                const expression &n = args[0];
+                if (auto k = native_cast<numeral>(n)) {
+                    return k->value ? falsity : truth;
+                }
+                if (native_cast<sum>(n)) {
+                    return falsity;
+                }
+                return tail_call(n, constant{falsity}, truth);
+            }
+
+            template <>
+            inline expression body<op::leq>(const expression *args)
+            {
+                const expression &n = args[0], &m = args[1];
+                /* 純粋な定義と同じく m、n の順に評価する */
+                if (auto b = native_cast<numeral>(m)) {
+                    if (auto a = native_cast<numeral>(n)) {
+                        return a->value <= b->value ? truth : falsity;
+                    }
+                }
+                return tail_call(is_zero, sub(n)(m));
+            }
+
+            template <>
+            inline expression body<op::eq>(const expression *args)
+            {
+                const expression &n = args[0], &m = args[1];
+                if (auto b = native_cast<numeral>(m)) {
+                    if (auto a = native_cast<numeral>(n)) {
+                        return a->value == b->value ? truth : falsity;
+                    }
+                }
+                return tail_call(leq(n)(m), leq(m)(n), falsity);
+            }
+
+            template <>
+            inline expression body<op::min>(const expression *args)
+            {
+                const expression &n = args[0], &m = args[1];
+                if (auto b = native_cast<numeral>(m)) {
+                    if (auto a = native_cast<numeral>(n)) {
+                        return church_encode(std::min(a->value, b->value));
+                    }
+                }
+                return tail_call(leq(n)(m), n, m);
+            }
+
+            template <>
+            inline expression body<op::max>(const expression *args)
+            {
+                const expression &n = args[0], &m = args[1];
+                if (auto b = native_cast<numeral>(m)) {
+                    if (auto a = native_cast<numeral>(n)) {
+                        return church_encode(std::max(a->value, b->value));
+                    }
+                }
+                return tail_call(leq(n)(m), m, n);
+            }
+
+            template <>
+            inline expression body<op::quot>(const expression *args)
+            {
+                const expression &n = args[0], &m = args[1];
+                if (auto b = native_cast<numeral>(m)) {
+                    if (b->value == 0) {
+                        return church_encode(0);
+                    }
+                    if (auto a = native_cast<numeral>(n)) {
+                        return church_encode(a->value / b->value);
+                    }
+                }
+                return tail_call(
+                    is_zero(m),
+                    church_encode(0),
+                    Y([m](expression f) {
+                        return [m, f](expression k) {
+                            tally::scope counting(tally::quot, false);
+                            return tail_call(leq(m)(k), succ(f(sub(k)(m))), church_encode(0));
+                        };
+                    })(n));
+            }
+
+            template <>
+            inline expression body<op::rem>(const expression *args)
+            {
+                const expression &n = args[0], &m = args[1];
+                if (auto b = native_cast<numeral>(m)) {
+                    if (auto a = native_cast<numeral>(n)) {
+                        return church_encode(b->value ? a->value % b->value : a->value);
+                    }
+                }
+                return tail_call(
+                    is_zero(m),
+                    n,
+                    Y([m](expression f) {
+                        return [m, f](expression k) {
+                            tally::scope counting(tally::rem, false);
+                            return tail_call(leq(m)(k), f(sub(k)(m)), k);
+                        };
+                    })(n));
+            }
+
+            template <>
+            inline expression body<op::cons>(const expression *args)
+            {
+                return pair{args[0], args[1]};
+            }
+
+            template <>
+            inline expression body<op::car>(const expression *args)
+            {
+                const expression &p = args[0];
+                if (auto c = native_cast<pair>(p)) {
+                    return c->first();
+                }
+                if (auto q = native_cast<sequence>(p)) {
+                    return q->empty() ? truth : q->at(0);
+                }
+                if (auto l = list_cast(p)) {
+                    return l->empty() ? truth : (*l->items)[l->first];
+                }
+                return tail_call(p, truth);
+            }
+
+            template <>
+            inline expression body<op::cdr>(const expression *args)
+            {
+                const expression &p = args[0];
+                if (auto c = native_cast<pair>(p)) {
+                    return c->second();
+                }
+                if (auto q = native_cast<sequence>(p)) {
+                    if (q->empty()) {
+                        return truth;
+                    }
+                    return q->drop(1);
+                }
+                if (auto l = list_cast(p)) {
+                    if (l->empty()) {
+                        return truth;
+                    }
+                    return list{l->items, l->first + 1, l->last};
+                }
+                return tail_call(p, falsity);
+            }
+
+            template <>
+            inline expression body<op::is_empty>(const expression *args)
+            {
+                const expression &l = args[0];
+                if (native_cast<pair>(l)) {
+                    return falsity;
+                }
+                if (auto q = native_cast<pipeline>(l); q && !q->filters()) {
+                    return q->source_size() ? falsity : truth;
+                }
+                if (auto q = native_cast<sequence>(l)) {
+                    return q->empty() ? truth : falsity;
+                }
+                if (auto v = list_cast(l)) {
+                    return v->empty() ? truth : falsity;
+                }
+                return tail_call(
+                    l,
+                    [](expression x) {
+                        return [](expression y) {
+                            tally::scope counting(tally::is_empty, false);
+                            return falsity;
+                        };
+                    });
+            }
+
+            template <>
+            inline expression body<op::length>(const expression *args)
+            {
+                expression l = args[0];
+                std::size_t n = skip(l, std::numeric_limits<std::size_t>::max());
+                if (native_cast<list>(l)) {
+                    return church_encode(n);
+                }
+                expression rest = is_empty(l)(church_encode(0))(succ(length(cdr(l))));
+                return n ? tail_call(add, church_encode(n), rest) : rest;
+            }
+
+            template <>
+            inline expression body<op::map>(const expression *args)
+            {
+                const expression &f = args[0], &l = args[1];
+                if (auto p = native_cast<pair>(l)) {
+                    return pair{f(p->first()), map(f)(p->second())};
+                }
+                if (auto v = native_cast<list>(l)) {
+                    return pipeline(*v, {{false, f}});
+                }
+                if (auto q = native_cast<pipeline>(l)) {
+                    return q->then({false, f});
+                }
+                if (auto q = native_cast<sequence>(l)) {
+                    return pipeline(flatten(*q), {{false, f}});
+                }
+                return tail_call(is_empty, l, empty_list, cons(f(car(l)))(map(f)(cdr(l))));
+            }
+
+            template <>
+            inline expression body<op::foldl>(const expression *args)
+            {
+                const expression &f = args[0], &z = args[1];
+                expression l = args[2];
+                expression acc = z;
+                if (walk(l, [&f, &acc](const expression &x) { acc = f(acc)(x); whnf(acc); })) {
+                    return acc;
+                }
+                return tail_call(is_empty, l, acc, foldl(f)(f(acc)(car(l)))(cdr(l)));
+            }
+
+            template <>
+            inline expression body<op::foldr>(const expression *args)
+            {
+                const expression &f = args[0], &z = args[1];
+                expression l = args[2];
+                if (auto p = native_cast<pair>(l)) {
+                    return tail_call(f, p->first(), foldr(f)(z)(p->second()));
+                }
+                if (auto q = native_cast<sequence>(l)) {
+                    l = flatten(*q);
+                }
+                if (auto v = list_cast(l)) {
+                    expression acc = z;
+                    for (std::size_t i = v->last; i-- > v->first;) {
+                        acc = f((*v->items)[i])(acc);
+                    }
+                    return acc;
+                }
+                return tail_call(is_empty, l, z, f(car(l))(foldr(f)(z)(cdr(l))));
+            }
+
+            template <>
+            inline expression body<op::append>(const expression *args)
+            {
+                const expression &l = args[0], &m = args[1];
+                if (auto p = native_cast<pair>(l)) {
+                    return pair{p->first(), append(p->second())(m)};
+                }
+                if (auto q = native_cast<sequence>(l)) {
+                    /* 純粋な定義は m を評価せずに弱頭部正規形になるので、平衡二分木につなぎ合わせるのは m が評価済みのときだけにする */
+                    if (auto r = peek_cast<sequence>(m)) {
+                        return q->concat(*r);
+                    }
+                    if (auto w = peek_cast<list>(m)) {
+                        if (w->empty()) {
+                            return l;
+                        }
+                        return q->concat(sequence::from(std::vector<expression>(w->items->begin() + w->first, w->items->begin() + w->last)));
+                    }
+                    list v = flatten(*q);
+                    expression acc = m;
+                    for (std::size_t i = v.last; i-- > v.first;) {
+                        acc = pair{(*v.items)[i], acc};
+                    }
+                    return acc;
+                }
+                if (auto v = list_cast(l)) {
+                    if (v->empty()) {
+                        return m;
+                    }
+                    /* 純粋な定義は m を評価せずに弱頭部正規形になるので、m をつなぎ合わせるのは評価済みのときだけにする */
+                    if (auto r = peek_cast<sequence>(m)) {
+                        return sequence::from(std::vector<expression>(v->items->begin() + v->first, v->items->begin() + v->last)).concat(*r);
+                    }
+                    if (auto w = peek_cast<list>(m)) {
+                        if (w->empty()) {
+                            return l;
+                        }
+                        auto items = std::make_shared<std::vector<expression>>(v->items->begin() + v->first, v->items->begin() + v->last);
+                        items->insert(items->end(), w->items->begin() + w->first, w->items->begin() + w->last);
+                        return list{items, 0, items->size()};
+                    }
+                    expression acc = m;
+                    for (std::size_t i = v->last; i-- > v->first;) {
+                        acc = pair{(*v->items)[i], acc};
+                    }
+                    return acc;
+                }
+                return tail_call(is_empty, l, m, cons(car(l))(append(cdr(l))(m)));
+            }
+
+            template <>
+            inline expression body<op::reverse>(const expression *args)
+            {
+                expression l = args[0];
+                std::vector<expression> prefix;
+                bool complete = walk(l, [&prefix](const expression &x) { prefix.push_back(x); });
+                auto items = std::make_shared<std::vector<expression>>(prefix.rbegin(), prefix.rend());
+                expression reversed = list{items, 0, items->size()};
+                if (complete) {
+                    return reversed;
+                }
+                expression rest = foldl(
+                    [](expression acc) {
+                        return [acc](expression x) {
+                            tally::scope counting(tally::reverse, false);
+                            return cons(x)(acc);
+                        };
+                    })(empty_list)(l);
+                return prefix.empty() ? rest : tail_call(append, rest, reversed);
+            }
+
+            template <>
+            inline expression body<op::nth>(const expression *args)
+            {
+                const expression &n = args[0];
+                expression l = args[1];
+                if (auto k = native_cast<numeral>(n)) {
+                    std::size_t skipped = skip(l, k->value);
+                    if (skipped == k->value || native_cast<list>(l)) {
+                        return tail_call(car, l);
+                    }
+                    return tail_call(car, church_encode(k->value - skipped)(cdr)(l));
+                }
+                return tail_call(car, n(cdr)(l));
+            }
+
+            template <>
+            inline expression body<op::take>(const expression *args)
+            {
+                const expression &n = args[0], &l = args[1];
+                if (auto k = native_cast<numeral>(n)) {
+                    if (k->value == 0) {
+                        return empty_list;
+                    }
+                    if (auto p = native_cast<pair>(l)) {
+                        return pair{p->first(), take(church_encode(k->value - 1))(p->second())};
+                    }
+                    if (auto q = native_cast<sequence>(l)) {
+                        return q->take(std::min(k->value, q->size()));
+                    }
+                    if (auto v = list_cast(l)) {
+                        return list{v->items, v->first, v->first + std::min(k->value, v->last - v->first)};
+                    }
+                }
+                return tail_call(is_zero, n, empty_list, is_empty(l)(empty_list)(cons(car(l))(take(pred(n))(cdr(l)))));
+            }
+
+            template <>
+            inline expression body<op::drop>(const expression *args)
+            {
+                const expression &n = args[0];
+                expression l = args[1];
+                if (auto k = native_cast<numeral>(n)) {
+                    std::size_t skipped = skip(l, k->value);
+                    if (skipped == k->value || native_cast<list>(l)) {
+                        return l;
+                    }
+                    return tail_call(is_empty, l, l, drop(church_encode(k->value - skipped - 1))(cdr(l)));
+                }
+                return tail_call(is_zero, n, l, is_empty(l)(l)(drop(pred(n))(cdr(l))));
+            }
+
+            template <>
+            inline expression body<op::update>(const expression *args)
+            {
+                const expression &n = args[0], &y = args[1], &l = args[2];
+                if (auto k = native_cast<numeral>(n)) {
+                    if (auto q = native_cast<sequence>(l)) {
+                        return k->value < q->size() ? expression(q->update(k->value, y)) : l;
+                    }
+                    if (auto v = list_cast(l)) {
+                        if (k->value >= v->last - v->first) {
+                            return l;
+                        }
+                        auto items = std::make_shared<std::vector<expression>>(v->items->begin() + v->first, v->items->begin() + v->last);
+                        (*items)[k->value] = y;
+                        return list{items, 0, items->size()};
+                    }
+                }
+                return tail_call(is_empty, l, l, is_zero(n)(cons(y)(cdr(l)))(cons(car(l))(update(pred(n))(y)(cdr(l)))));
+            }
+
+            template <>
+            inline expression body<op::filter>(const expression *args)
+            {
+                const expression &p = args[0];
+                expression l = args[1];
+                while (auto c = native_cast<pair>(l)) {
+                    if (decide(p(c->first()))) {
+                        return pair{c->first(), filter(p)(c->second())};
+                    }
+                    l = c->second();
+                }
+                if (auto v = native_cast<list>(l)) {
+                    return pipeline(*v, {{true, p}});
+                }
+                if (auto q = native_cast<pipeline>(l)) {
+                    return q->then({true, p});
+                }
+                if (auto q = native_cast<sequence>(l)) {
+                    return pipeline(flatten(*q), {{true, p}});
+                }
+                expression rest = filter(p)(cdr(l));
+                return tail_call(is_empty, l, empty_list, p(car(l))(cons(car(l))(rest))(rest));
+            }
+        }
+
+        inline expression invoke(op code, const expression *args)
+        {
+            static tally::counter *const counters[] = {
+                &tally::Y, &tally::I, &tally::K, &tally::S, &tally::i, &tally::succ, &tally::pred, &tally::add, &tally::sub, &tally::mult,
+                &tally::power, &tally::is_zero, &tally::leq, &tally::eq, &tally::min, &tally::max, &tally::quot, &tally::rem, &tally::cons,
+                &tally::car, &tally::cdr, &tally::is_empty, &tally::length, &tally::map, &tally::foldl, &tally::foldr, &tally::append,
+                &tally::reverse, &tally::nth, &tally::take, &tally::drop, &tally::update, &tally::filter};
+            tally::scope counting(*counters[static_cast<std::size_t>(code)]);
+#ifdef LAMBDA_PROFILE
+            profile::scope located(builtin::name(code), 0);
+#endif
+            switch (code) {
+            case op::Y:
+                return builtins::body<op::Y>(args);
+            case op::I:
+                return builtins::body<op::I>(args);
+            case op::K:
+                return builtins::body<op::K>(args);
+            case op::S:
+                return builtins::body<op::S>(args);
+            case op::i:
+                return builtins::body<op::i>(args);
+            case op::succ:
+                return builtins::body<op::succ>(args);
+            case op::pred:
+                return builtins::body<op::pred>(args);
+            case op::add:
+                return builtins::body<op::add>(args);
+            case op::sub:
+                return builtins::body<op::sub>(args);
+            case op::mult:
+                return builtins::body<op::mult>(args);
+            case op::power:
+                return builtins::body<op::power>(args);
+            case op::is_zero:
+                return builtins::body<op::is_zero>(args);
+            case op::leq:
+                return builtins::body<op::leq>(args);
+            case op::eq:
+                return builtins::body<op::eq>(args);
+            case op::min:
+                return builtins::body<op::min>(args);
+            case op::max:
+                return builtins::body<op::max>(args);
+            case op::quot:
+                return builtins::body<op::quot>(args);
+            case op::rem:
+                return builtins::body<op::rem>(args);
+            case op::cons:
+                return builtins::body<op::cons>(args);
+            case op::car:
+                return builtins::body<op::car>(args);
+            case op::cdr:
+                return builtins::body<op::cdr>(args);
+            case op::is_empty:
+                return builtins::body<op::is_empty>(args);
+            case op::length:
+                return builtins::body<op::length>(args);
+            case op::map:
+                return builtins::body<op::map>(args);
+            case op::foldl:
+                return builtins::body<op::foldl>(args);
+            case op::foldr:
+                return builtins::body<op::foldr>(args);
+            case op::append:
+                return builtins::body<op::append>(args);
+            case op::reverse:
+                return builtins::body<op::reverse>(args);
+            case op::nth:
+                return builtins::body<op::nth>(args);
+            case op::take:
+                return builtins::body<op::take>(args);
+            case op::drop:
+                return builtins::body<op::drop>(args);
+            case op::update:
+                return builtins::body<op::update>(args);
+            case op::filter:
+                return builtins::body<op::filter>(args);
+            }
+            return expression();
+        }
+    }
+
+    namespace native {
+        /**
+         * @brief スコットリストの要素を先頭から順に取り出す
+         * @param[in] l 取り出すリスト
+         * @param[in] visit 各要素に対して呼び出す関数。false を返したらそこで打ち切る
+         * @detail ネイティブ表現のセルはそのまま辿り、それ以外のセルは is_empty, car, cdr で分解する。
+         * 辿り終えたセルは手放すので、遅延されたリストを一定のメモリで流し込める。
+         */
+        template <class Visitor>
+        inline void drain(expression l, Visitor visit)
+        {
+            bool stopped = false;
+            auto put = [&visit, &stopped](const expression &x) {
+                stopped = stopped || !visit(x);
+            };
+            while (!stopped) {
+                if (auto p = native_cast<pair>(l)) {
+                    put(p->first());
+                    l = p->second();
+                } else if (walk(l, put) || decide(combinators::is_empty(l))) {
+                    break;
+                } else {
+                    put(combinators::car(l));
+                    l = combinators::cdr(l);
+                }
+            }
+        }
+    }
+
+    namespace native {
+        inline expression sum::total(std::size_t value, const expression &terms)
+        {
+            std::size_t count = value;
+            std::vector<expression> rest;
+            /* 足す式がまた sum であっても再帰しないよう、辿るリストを手元に積む */
+            std::vector<expression> pending{terms};
+            while (!pending.empty()) {
+                expression l = std::move(pending.back());
+                pending.pop_back();
+                while (auto p = native_cast<pair>(l)) {
+                    const expression &x = p->first();
+                    if (auto k = native_cast<numeral>(x)) {
+                        count += k->value;
+                    } else if (auto t = native_cast<sum>(x)) {
+                        count += t->value;
+                        pending.push_back(t->terms);
+                    } else {
+                        rest.push_back(x);
+                    }
+                    l = p->second();
+                }
+            }
+            expression result = church_encode(count);
+            for (const auto &x : rest) {
+                /* 一つずつ評価し、足す式を深く入れ子にしない */
+                result = x(combinators::succ)(result);
+                whnf(result);
+            }
+            return result;
+        }
     }
 
     /**
@@ -227,6 +2450,12 @@ namespace lambda {
      */
     inline std::size_t church_decode(expression n)
     {
+        if (auto k = native_cast<native::numeral>(n)) {
+            return k->value;
+        }
+        if (auto s = native_cast<native::sum>(n)) {
+            return church_decode(s->resolve());
+        }
         std::size_t decoded = 0;
         n.pass_by_value(
              [&decoded](expression x) {++decoded; return x; })
@@ -244,12 +2473,8 @@ namespace lambda {
     template <class InputIterator>
     inline expression scott_encode(InputIterator first, InputIterator last)
     {
-        return std::accumulate(
-            std::reverse_iterator(last), std::reverse_iterator(first),
-            combinators::empty_list,
-            [](expression acc, expression e) {
-                return combinators::cons(e)(acc);
-            });
+        auto items = std::make_shared<std::vector<expression>>(first, last);
+        return native::list{items, 0, items->size()};
     }
 
 
@@ -261,6 +2486,9 @@ namespace lambda {
     template <class OutputIterator>
     inline void scott_decode(expression list, OutputIterator result)
     {
+        if (native::walk(list, [&result](const expression &x) { *result++ = x; })) {
+            return;
+        }
         expression _output_list = [&result](expression f) {
             return [&result, f](expression l) {
                 return combinators::is_empty.pass_by_value(l)
@@ -276,6 +2504,32 @@ namespace lambda {
         combinators::Y.pass_by_value(_output_list).pass_by_value(list).pass_by_value(combinators::I).pass_by_value(combinators::I);
     }
 
+    /**
+     * @brief 平衡二分木に格納されたスコットエンコーディングによるリストを作成する
+     * @param[in] first 先頭要素を指すイテレータ
+     * @param[in] last 最後の要素の次を指すイテレータ
+     * @return スコットエンコーディングによるエンコード結果
+     * @detail 結果は scott_encode と同じくスコットリストとして振る舞うが、
+     * nth, update, append, take, drop をいずれも O(log n) で行える。
+     */
+    template <class InputIterator>
+    inline expression sequence_encode(InputIterator first, InputIterator last)
+    {
+        return native::sequence::from(std::vector<expression>(first, last));
+    }
+
+    /**
+     * @brief sequence_encode で作ったリストを分解する
+     * @param[in] list スコットエンコーディングによるリスト
+     * @param[out] result リストに含まれていた各ラムダ式の出力先
+     * @detail 任意のスコットリストを受け付ける点も含め、scott_decode と同じ動作をする。
+     */
+    template <class OutputIterator>
+    inline void sequence_decode(expression list, OutputIterator result)
+    {
+        scott_decode(std::move(list), result);
+    }
+
     /**
      * @brief 自然数の列に対しラムダ計算によるプログラムを実行する
      * @param[in] first 先頭要素を指すイテレータ
@@ -290,10 +2544,55 @@ namespace lambda {
     template <class InputIterator, class OutputIterator>
     inline void run_on_integer_sequence(InputIterator first, InputIterator last, expression program, OutputIterator result)
     {
-        std::vector<expression> church_encoded;
-        std::transform(first, last, std::back_inserter(church_encoded), church_encode);
-        std::vector<expression> scott_decoded;
-        scott_decode(program(scott_encode(church_encoded.begin(), church_encoded.end())), std::back_inserter(scott_decoded));
-        std::transform(scott_decoded.begin(), scott_decoded.end(), result, church_decode);
+        auto items = std::make_shared<std::vector<expression>>();
+        std::transform(first, last, std::back_inserter(*items), church_encode);
+        native::drain(program(native::list{items, 0, items->size()}), [&result](const expression &x) {
+            *result++ = church_decode(x);
+            return true;
+        });
+    }
+
+    /**
+     * @brief 実装の型を読める名前にする
+     * @param[in] type 実装の型
+     * @return ネイティブ表現や組み込みのコンビネータであればその名前、そうでなければデマングルした型名
+     * @detail 組み込みのコンビネータが引数を受け取る途中の段は、名前に " (partial)" を添える。
+     */
+    inline std::string trace::describe(const std::type_info &type)
+    {
+        static const std::vector<std::pair<const std::type_info *, std::string>> names = [] {
+            std::vector<std::pair<const std::type_info *, std::string>> names = {
+                {&typeid(native::boolean), "boolean"},
+                {&typeid(native::constant), "constant"},
+                {&typeid(native::numeral), "numeral"},
+                {&typeid(native::pair), "pair"},
+                {&typeid(native::list), "list"},
+                {&typeid(native::pipeline), "pipeline"},
+                {&typeid(native::sequence), "sequence"},
+                {&typeid(native::fixpoint), "fixpoint"},
+                {&typeid(expression::thunk), "thunk"},
+            };
+            for (std::size_t i = 0; i < native::ops; ++i) {
+                auto code = static_cast<native::op>(i);
+                names.push_back({&native::builtin::type(code, false), native::builtin::name(code)});
+                names.push_back({&native::builtin::type(code, true), native::builtin::name(code) + std::string(" (partial)")});
+            }
+            return names;
+        }();
+        for (const auto &[t, name] : names) {
+            if (*t == type) {
+                return name;
+            }
+        }
+        /* 本体が返した途中の段は、そのコンビネータの名前で呼ぶ */
+        std::string name = demangle(type);
+        const std::string prefix = "lambda::native::builtins::body<(lambda::native::op)";
+        if (name.compare(0, prefix.size(), prefix) == 0) {
+            std::size_t code = std::stoul(name.substr(prefix.size()));
+            if (code < native::ops) {
+                return native::builtin::name(static_cast<native::op>(code)) + std::string(" (partial)");
+            }
+        }
+        return name;
     }
 }
@@ -0,0 +1,616 @@
+/**
+ * @file lambda-heap.hpp
+ * @brief ラムダ式が指すデータの網を調べ、何がどれだけのメモリを握っているかを明らかにします。
+ */
+
+#pragma once
+
+#include "lambda-adt.hpp"
+#include "lambda-checkpoint.hpp"
+#include "lambda-expression.hpp"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace lambda {
+    namespace heap {
+        /** 節の種類 */
+        enum class kind : unsigned char {
+            thunk,       /**< 名前呼びによって遅延された適用のセル */
+            pair,        /**< スコットリストのセル */
+            array,       /**< 要素を並べた配列 */
+            list,        /**< 配列に格納されたリスト */
+            pipeline,    /**< map と filter を重ねたリスト */
+            sequence,    /**< 平衡二分木に格納されたリスト */
+            branch,      /**< 平衡二分木の節 */
+            numeral,     /**< チャーチ数。まだ評価していない数を足したものを含む */
+            boolean,     /**< チャーチブール値 */
+            constant,    /**< 定数関数 */
+            constructor, /**< 代数的データ型の値 */
+            choice,      /**< 代数的データ型の値を場合分けする途中の関数 */
+            collector,   /**< 代数的データ型の値を作る途中の関数 */
+            fixpoint,    /**< 不動点コンビネータの結果への再帰的な参照 */
+            partial,     /**< 引数を受け取る途中の組み込みのコンビネータ */
+            combinator,  /**< 名簿に載っている関数 */
+            closure      /**< そのほかの関数。捕捉した値の中身は見えない */
+        };
+
+        static constexpr std::size_t kinds = static_cast<std::size_t>(kind::closure) + 1;
+
+        inline const char *name(kind k)
+        {
+            static const char *const names[kinds] = {
+                "thunk", "pair", "array", "list", "pipeline", "sequence", "branch", "numeral",
+                "boolean", "constant", "constructor", "choice", "collector", "fixpoint", "partial", "combinator", "closure"};
+            return names[static_cast<std::size_t>(k)];
+        }
+
+        /** make_shared などで確保した領域に付く管理用の領域の大きさの見積もり */
+        static constexpr std::size_t control_block = 2 * sizeof(long);
+
+        /** 一つの節 */
+        struct node {
+            kind what = kind::closure;
+
+            /** 種類に添える説明。数の値や関数の名前など */
+            std::string label;
+
+            /** 節そのものが占める大きさの見積もり (バイト) */
+            std::size_t bytes = 0;
+
+            /** この節を通らなければ根から辿れない節の大きさの合計。自身を含む */
+            std::size_t retained = 0;
+
+            /** この節を指している参照の数。根からの参照も含む */
+            std::size_t references = 0;
+
+            /** 根から最短でこの節に至る経路での一つ手前の節。根であれば自身 */
+            std::size_t parent = 0;
+
+            /** 指している節 */
+            std::vector<std::size_t> children;
+        };
+
+        /** 文字列を JSON や DOT の引用符の中に置けるようにする */
+        inline std::string quote(const std::string &s)
+        {
+            std::string r = "\"";
+            for (char c : s) {
+                if (c == '"' || c == '\\') {
+                    r += '\\';
+                    r += c;
+                } else if (static_cast<unsigned char>(c) < 0x20) {
+                    char buffer[8];
+                    std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                    r += buffer;
+                } else {
+                    r += c;
+                }
+            }
+            return r + '"';
+        }
+    }
+
+    /**
+     * @brief ある時点でラムダ式から辿れるデータの網の写し
+     * @detail 共有されたセルや配列は一つの節として数え、参照の数から共有の度合いを求める。
+     * 支配木を求め、各節を手放したときに解放される大きさを retained として見積もる。
+     * 大きさは共有されるセルと配列の分だけを数え、std::function の中に置かれた関数やその捕捉した値は含まない。
+     * 網を辿るのは写しを作るときだけで、作ったあとは元の式を参照しない。
+     */
+    class heap_snapshot final {
+    private:
+        using access = checkpoint::access;
+
+        std::vector<heap::node> _nodes;
+        std::vector<std::pair<std::string, std::size_t>> _roots;
+
+        /** 網を辿る途中の節。expression, array, branch のいずれかを指す */
+        struct frame {
+            heap::kind what;
+            const void *p;
+        };
+
+        /** 節を同一視するための鍵。checkpoint::writer と同じく、何の番地かも添える */
+        struct identity {
+            const void *p;
+            int what;
+
+            bool operator==(const identity &other) const
+            {
+                return p == other.p && what == other.what;
+            }
+        };
+
+        struct hash {
+            std::size_t operator()(const identity &k) const
+            {
+                return std::hash<const void *>()(k.p) ^ static_cast<std::size_t>(k.what);
+            }
+        };
+
+        const checkpoint::registry &_registry;
+        std::unordered_map<identity, std::size_t, hash> _numbers;
+        std::vector<frame> _frames;
+
+        identity identify(const expression &e) const
+        {
+            if (auto t = access::target<access::thunk>(e)) {
+                return {access::identity(*t), 1};
+            }
+            if (auto p = access::target<native::pair>(e)) {
+                return {&p->first(), 2};
+            }
+            if (_registry.name_of(e)) {
+                return {&access::type(e), 3};
+            }
+            return {&e, 4};
+        }
+
+        /**
+         * @brief 節を番号に対応付ける
+         * @return 番号。初めて見た節であれば新しく番号を振る
+         */
+        std::size_t number(heap::kind what, const void *p, std::size_t parent)
+        {
+            identity key = what == heap::kind::array ? identity{p, 5} : what == heap::kind::branch ? identity{p, 6} : identify(*static_cast<const expression *>(p));
+            auto [it, inserted] = _numbers.try_emplace(key, _nodes.size());
+            if (inserted) {
+                heap::node n;
+                n.what = what;
+                n.parent = parent == static_cast<std::size_t>(-1) ? it->second : parent;
+                _nodes.push_back(std::move(n));
+                _frames.push_back({what, p});
+            }
+            ++_nodes[it->second].references;
+            return it->second;
+        }
+
+        /** 節の種類と大きさと説明を埋め、指している節を訪れる */
+        template <class Visitor>
+        void describe(heap::node &n, const frame &f, Visitor visit) const
+        {
+            auto expr = [&visit](const expression &x) {
+                if (!access::empty(x)) {
+                    visit(heap::kind::closure, &x);
+                }
+            };
+            auto array = [&visit](const std::shared_ptr<const std::vector<expression>> &v) {
+                if (v) {
+                    visit(heap::kind::array, v.get());
+                }
+            };
+            if (f.what == heap::kind::array) {
+                auto &items = *static_cast<const std::vector<expression> *>(f.p);
+                n.bytes = heap::control_block + sizeof(items) + items.capacity() * sizeof(expression);
+                n.label = std::to_string(items.size());
+                for (const auto &x : items) {
+                    expr(x);
+                }
+                return;
+            }
+            if (f.what == heap::kind::branch) {
+                auto t = static_cast<const access::node *>(f.p);
+                n.bytes = heap::control_block + sizeof(access::node);
+                if (t->left) {
+                    visit(heap::kind::branch, t->left.get());
+                }
+                expr(t->value);
+                if (t->right) {
+                    visit(heap::kind::branch, t->right.get());
+                }
+                return;
+            }
+            const expression &e = *static_cast<const expression *>(f.p);
+            n.bytes = 0;
+            if (auto t = access::target<access::thunk>(e)) {
+                n.what = heap::kind::thunk;
+                n.bytes = heap::control_block + access::cell_size;
+                if (auto v = t->evaluated()) {
+                    n.label = "ready";
+                    expr(*v);
+                } else {
+                    n.label = access::application(*t).first ? "unevaluated" : "evaluating";
+                    auto [function, argument] = access::operands(*t);
+                    expr(*function);
+                    expr(*argument);
+                }
+            } else if (auto p = access::target<native::pair>(e)) {
+                n.what = heap::kind::pair;
+                n.bytes = heap::control_block + 2 * sizeof(expression);
+                expr(p->first());
+                expr(p->second());
+            } else if (auto v = access::target<native::list>(e)) {
+                n.what = heap::kind::list;
+                n.label = std::to_string(v->last - v->first);
+                array(v->items);
+            } else if (auto q = access::target<native::pipeline>(e)) {
+                n.what = heap::kind::pipeline;
+                n.label = std::to_string(access::stages(*q).size()) + " stages";
+                if (auto v = access::materialized(*q)) {
+                    array(v->items);
+                }
+                array(access::source(*q).items);
+                for (const auto &s : access::stages(*q)) {
+                    expr(s.function);
+                }
+            } else if (auto q = access::target<native::sequence>(e)) {
+                n.what = heap::kind::sequence;
+                n.label = std::to_string(q->size());
+                if (auto &root = access::root(*q)) {
+                    visit(heap::kind::branch, root.get());
+                }
+            } else if (auto x = access::target<native::numeral>(e)) {
+                n.what = heap::kind::numeral;
+                n.label = std::to_string(x->value);
+            } else if (auto x = access::target<native::sum>(e)) {
+                n.what = heap::kind::numeral;
+                n.label = std::to_string(x->value) + "+";
+                expr(x->terms);
+            } else if (auto b = access::target<native::boolean>(e)) {
+                n.what = heap::kind::boolean;
+                n.label = b->value ? "true" : "false";
+            } else if (auto c = access::target<native::constant>(e)) {
+                n.what = heap::kind::constant;
+                expr(c->value);
+            } else if (auto c = access::target<native::constructor>(e)) {
+                n.what = heap::kind::constructor;
+                n.label = std::to_string(c->index) + "/" + std::to_string(c->count);
+                array(c->fields);
+            } else if (auto c = access::target<native::choice>(e)) {
+                n.what = heap::kind::choice;
+                expr(c->handler);
+                array(c->fields);
+            } else if (auto c = access::target<native::collector>(e)) {
+                n.what = heap::kind::collector;
+                array(c->fields);
+            } else if (auto y = access::target<native::fixpoint>(e)) {
+                n.what = heap::kind::fixpoint;
+                expr(y->function);
+            } else if (auto p = access::target<native::partial>(e)) {
+                n.what = heap::kind::partial;
+                n.bytes = heap::control_block + sizeof(native::partial);
+                n.label = native::builtin::name(p->code);
+                for (std::size_t i = 0; i < p->count; ++i) {
+                    expr(p->args[i]);
+                }
+            } else if (auto name = _registry.name_of(e)) {
+                n.what = heap::kind::combinator;
+                n.label = *name;
+            } else {
+                n.what = heap::kind::closure;
+                n.label = trace::describe(access::type(e));
+            }
+        }
+
+        /** 支配木を求め、各節の retained を埋める */
+        void dominate()
+        {
+            std::size_t count = _nodes.size();
+            std::size_t top = count; /* すべての根を指す仮の根 */
+            const std::size_t none = static_cast<std::size_t>(-1);
+
+            /* 仮の根から深さ優先で辿り、帰りがけ順の番号を振る */
+            std::vector<std::size_t> postorder(count + 1, none);
+            std::vector<std::size_t> order;
+            order.reserve(count + 1);
+            std::vector<char> seen(count + 1, 0);
+            std::vector<std::pair<std::size_t, std::size_t>> stack{{top, 0}};
+            seen[top] = 1;
+            std::vector<std::size_t> root_indices;
+            for (const auto &r : _roots) {
+                root_indices.push_back(r.second);
+            }
+            while (!stack.empty()) {
+                auto &[v, i] = stack.back();
+                const auto &next = v == top ? root_indices : _nodes[v].children;
+                if (i < next.size()) {
+                    std::size_t w = next[i++];
+                    if (!seen[w]) {
+                        seen[w] = 1;
+                        stack.push_back({w, 0});
+                    }
+                    continue;
+                }
+                postorder[v] = order.size();
+                order.push_back(v);
+                stack.pop_back();
+            }
+
+            /* 各節を指している節の一覧 */
+            std::vector<std::size_t> first(count + 2, 0);
+            for (std::size_t v = 0; v < count; ++v) {
+                for (std::size_t w : _nodes[v].children) {
+                    ++first[w + 1];
+                }
+            }
+            for (std::size_t w : root_indices) {
+                ++first[w + 1];
+            }
+            for (std::size_t v = 0; v <= count; ++v) {
+                first[v + 1] += first[v];
+            }
+            std::vector<std::size_t> predecessors(first[count + 1]);
+            std::vector<std::size_t> fill(first.begin(), first.end() - 1);
+            for (std::size_t v = 0; v < count; ++v) {
+                for (std::size_t w : _nodes[v].children) {
+                    predecessors[fill[w]++] = v;
+                }
+            }
+            for (std::size_t w : root_indices) {
+                predecessors[fill[w]++] = top;
+            }
+
+            /* Cooper, Harvey, Kennedy による反復的な支配木の計算 */
+            std::vector<std::size_t> dominator(count + 1, none);
+            dominator[top] = top;
+            auto intersect = [&](std::size_t a, std::size_t b) {
+                while (a != b) {
+                    while (postorder[a] < postorder[b]) {
+                        a = dominator[a];
+                    }
+                    while (postorder[b] < postorder[a]) {
+                        b = dominator[b];
+                    }
+                }
+                return a;
+            };
+            for (bool changed = true; changed;) {
+                changed = false;
+                for (auto it = order.rbegin(); it != order.rend(); ++it) {
+                    std::size_t v = *it;
+                    if (v == top) {
+                        continue;
+                    }
+                    std::size_t d = none;
+                    for (std::size_t k = first[v]; k < first[v + 1]; ++k) {
+                        std::size_t p = predecessors[k];
+                        if (dominator[p] != none) {
+                            d = d == none ? p : intersect(p, d);
+                        }
+                    }
+                    if (dominator[v] != d) {
+                        dominator[v] = d;
+                        changed = true;
+                    }
+                }
+            }
+
+            /* 帰りがけ順では、支配される節が支配する節より先に来る */
+            for (std::size_t v = 0; v < count; ++v) {
+                _nodes[v].retained = _nodes[v].bytes;
+            }
+            for (std::size_t v : order) {
+                if (v != top && dominator[v] != top) {
+                    _nodes[dominator[v]].retained += _nodes[v].retained;
+                }
+            }
+        }
+
+    public:
+        /**
+         * @brief 写しを作る
+         * @param[in] roots 根とする式とその名前の一覧
+         * @param[in] names 名前で表示する関数の名簿
+         * @detail 評価済みのサンクも、その値を保持している節として数える。
+         * 深いリストでもスタックを溢れさせないよう、明示的な待ち行列を使って幅優先で辿る。
+         * ほかのスレッドが評価している間に呼び出さないこと。評価を中断している task の合間であれば呼び出してよい。
+         */
+        explicit heap_snapshot(const std::vector<std::pair<std::string, expression>> &roots, const checkpoint::registry &names = checkpoint::registry::standard())
+            : _registry(names)
+        {
+            for (const auto &[name, e] : roots) {
+                if (!access::empty(e)) {
+                    _roots.push_back({name, number(heap::kind::closure, &e, static_cast<std::size_t>(-1))});
+                }
+            }
+            for (std::size_t i = 0; i < _nodes.size(); ++i) {
+                frame f = _frames[i];
+                heap::node n = std::move(_nodes[i]);
+                describe(n, f, [this, &n, i](heap::kind what, const void *p) {
+                    n.children.push_back(number(what, p, i));
+                });
+                n.references = _nodes[i].references;
+                _nodes[i] = std::move(n);
+            }
+            _frames.clear();
+            _frames.shrink_to_fit();
+            _numbers.clear();
+            dominate();
+        }
+
+        /**
+         * @brief 一つの式を根として写しを作る
+         * @param[in] root 根とする式
+         */
+        explicit heap_snapshot(const expression &root)
+            : heap_snapshot({{"root", root}})
+        {
+        }
+
+        /** すべての節。番号で参照する */
+        const std::vector<heap::node> &nodes() const
+        {
+            return _nodes;
+        }
+
+        /** 根の名前と節の番号 */
+        const std::vector<std::pair<std::string, std::size_t>> &roots() const
+        {
+            return _roots;
+        }
+
+        /** 節の大きさの合計 (バイト) */
+        std::size_t total_bytes() const
+        {
+            std::size_t total = 0;
+            for (const auto &n : _nodes) {
+                total += n.bytes;
+            }
+            return total;
+        }
+
+        /** 種類ごとの節の数 */
+        std::array<std::size_t, heap::kinds> counts() const
+        {
+            std::array<std::size_t, heap::kinds> c{};
+            for (const auto &n : _nodes) {
+                ++c[static_cast<std::size_t>(n.what)];
+            }
+            return c;
+        }
+
+        /**
+         * @brief 共有の度合い
+         * @return 節一つあたりの参照の数。1 を超えた分だけ共有されている
+         */
+        double sharing_ratio() const
+        {
+            std::size_t references = 0;
+            for (const auto &n : _nodes) {
+                references += n.references;
+            }
+            return _nodes.empty() ? 0.0 : static_cast<double>(references) / _nodes.size();
+        }
+
+        /**
+         * @brief 手放したときに解放される大きさの大きい節
+         * @param[in] n 取り出す数
+         * @return retained の大きい順に並べた節の番号
+         */
+        std::vector<std::size_t> largest(std::size_t n) const
+        {
+            std::vector<std::size_t> indices(_nodes.size());
+            for (std::size_t i = 0; i < indices.size(); ++i) {
+                indices[i] = i;
+            }
+            n = std::min(n, indices.size());
+            std::partial_sort(indices.begin(), indices.begin() + n, indices.end(), [this](std::size_t a, std::size_t b) {
+                return _nodes[a].retained > _nodes[b].retained;
+            });
+            indices.resize(n);
+            return indices;
+        }
+
+        /**
+         * @brief 根からある節に至る最短の経路
+         * @param[in] i 節の番号
+         * @return 根から i までの節の番号の並び
+         */
+        std::vector<std::size_t> retention_path(std::size_t i) const
+        {
+            std::vector<std::size_t> path{i};
+            while (_nodes[i].parent != i) {
+                i = _nodes[i].parent;
+                path.push_back(i);
+            }
+            std::reverse(path.begin(), path.end());
+            return path;
+        }
+
+        /**
+         * @brief 節の種類と説明を一語にする
+         * @param[in] i 節の番号
+         */
+        std::string title(std::size_t i) const
+        {
+            const heap::node &n = _nodes[i];
+            return n.label.empty() ? heap::name(n.what) : std::string(heap::name(n.what)) + ' ' + n.label;
+        }
+
+        /**
+         * @brief 概要を書き出す
+         * @param[out] out 出力先
+         * @param[in] top 書き出す大きな節の数
+         * @detail 種類ごとの節の数と大きさ、共有の度合い、retained の大きい節とそこに至る経路を書き出す。
+         * 長い経路は途中を省く。
+         */
+        void print(std::ostream &out, std::size_t top = 10) const
+        {
+            std::array<std::size_t, heap::kinds> bytes{};
+            for (const auto &n : _nodes) {
+                bytes[static_cast<std::size_t>(n.what)] += n.bytes;
+            }
+            auto c = counts();
+            out << "nodes " << _nodes.size() << ", bytes " << total_bytes() << ", sharing " << std::fixed << std::setprecision(3) << sharing_ratio() << '\n';
+            out << std::left << std::setw(12) << "kind" << std::right << std::setw(12) << "nodes" << std::setw(14) << "bytes" << '\n';
+            for (std::size_t k = 0; k < heap::kinds; ++k) {
+                if (c[k]) {
+                    out << std::left << std::setw(12) << heap::name(static_cast<heap::kind>(k)) << std::right << std::setw(12) << c[k] << std::setw(14) << bytes[k] << '\n';
+                }
+            }
+            out << "largest retained\n";
+            for (std::size_t i : largest(top)) {
+                out << std::setw(14) << _nodes[i].retained << "  ";
+                /* 長い経路は根に近い側と節に近い側だけを書き出す */
+                auto path = retention_path(i);
+                for (std::size_t k = 0; k < path.size(); ++k) {
+                    if (path.size() > 8 && k == 3) {
+                        out << " > ... " << path.size() - 7 << " nodes ...";
+                        k = path.size() - 5;
+                        continue;
+                    }
+                    out << (k ? " > " : "") << title(path[k]);
+                }
+                out << '\n';
+            }
+        }
+
+        /**
+         * @brief Graphviz の DOT 形式で書き出す
+         * @param[out] out 出力先
+         */
+        void write_dot(std::ostream &out) const
+        {
+            out << "digraph heap {\n";
+            for (std::size_t i = 0; i < _nodes.size(); ++i) {
+                const heap::node &n = _nodes[i];
+                std::string label = heap::quote(title(i));
+                label.insert(label.size() - 1, "\\n" + std::to_string(n.bytes) + " / " + std::to_string(n.retained) + " B");
+                out << "  n" << i << " [label=" << label << "];\n";
+            }
+            for (std::size_t r = 0; r < _roots.size(); ++r) {
+                out << "  r" << r << " [shape=box, label=" << heap::quote(_roots[r].first) << "];\n";
+                out << "  r" << r << " -> n" << _roots[r].second << ";\n";
+            }
+            for (std::size_t i = 0; i < _nodes.size(); ++i) {
+                for (std::size_t j : _nodes[i].children) {
+                    out << "  n" << i << " -> n" << j << ";\n";
+                }
+            }
+            out << "}\n";
+        }
+
+        /**
+         * @brief JSON 形式で書き出す
+         * @param[out] out 出力先
+         * @detail {"roots": [{"name", "node"}], "nodes": [{"id", "kind", "label", "bytes", "retained", "references", "children"}]} の形で書き出す。
+         */
+        void write_json(std::ostream &out) const
+        {
+            out << "{\"roots\":[";
+            for (std::size_t r = 0; r < _roots.size(); ++r) {
+                out << (r ? "," : "") << "{\"name\":" << heap::quote(_roots[r].first) << ",\"node\":" << _roots[r].second << '}';
+            }
+            out << "],\"nodes\":[";
+            for (std::size_t i = 0; i < _nodes.size(); ++i) {
+                const heap::node &n = _nodes[i];
+                out << (i ? ",\n" : "\n") << "{\"id\":" << i << ",\"kind\":\"" << heap::name(n.what) << "\",\"label\":" << heap::quote(n.label)
+                    << ",\"bytes\":" << n.bytes << ",\"retained\":" << n.retained << ",\"references\":" << n.references << ",\"children\":[";
+                for (std::size_t k = 0; k < n.children.size(); ++k) {
+                    out << (k ? "," : "") << n.children[k];
+                }
+                out << "]}";
+            }
+            out << "]}\n";
+        }
+    };
+}
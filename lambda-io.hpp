@@ -0,0 +1,331 @@
+/**
+ * @file lambda-io.hpp
+ * @brief ラムダ計算によるプログラムをファイル記述子やファイルの間のフィルタとして実行します。
+ */
+
+#pragma once
+
+#include "lambda-expression.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace lambda {
+    namespace io {
+        /**
+         * @brief 出力をバッファに溜めてまとめて書き出す
+         */
+        class output_buffer final {
+        private:
+            static constexpr std::size_t buffer_size = 1 << 16;
+            int _fd;
+            std::vector<unsigned char> _pending;
+
+        public:
+            /**
+             * @param[in] fd 出力のファイル記述子
+             */
+            explicit output_buffer(int fd)
+                : _fd(fd)
+            {
+                _pending.reserve(buffer_size);
+            }
+
+            /**
+             * @brief バイト列を出力する
+             * @param[in] bytes 出力するバイト列
+             * @param[in] n バイト数
+             */
+            void put(const unsigned char *bytes, std::size_t n)
+            {
+                _pending.insert(_pending.end(), bytes, bytes + n);
+                if (_pending.size() >= buffer_size) {
+                    flush();
+                }
+            }
+
+            /** 溜まった出力を書き出す */
+            void flush()
+            {
+                const unsigned char *p = _pending.data();
+                std::size_t left = _pending.size();
+                while (left) {
+                    ssize_t n = ::write(_fd, p, left);
+                    if (n < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        throw std::system_error(errno, std::generic_category(), "lambda::io::output_buffer::flush");
+                    }
+                    p += n;
+                    left -= n;
+                }
+                _pending.clear();
+            }
+        };
+
+        /**
+         * @brief 入力と出力のファイル記述子の組
+         * @detail 入力は必要になったときにまとめて読み込み、出力はバッファに溜めてまとめて書き出す。
+         * 入力を読み込む前には溜まった出力を書き出すので、対話的なプログラムでも応答が遅れない。
+         */
+        class byte_stream final : public std::enable_shared_from_this<byte_stream> {
+        private:
+            static constexpr std::size_t buffer_size = 1 << 16;
+            int _in;
+            output_buffer _out;
+
+        public:
+            /**
+             * @param[in] in 入力のファイル記述子
+             * @param[in] out 出力のファイル記述子
+             */
+            byte_stream(int in, int out)
+                : _in(in), _out(out)
+            {
+            }
+
+            /**
+             * @brief 入力の残りをチャーチ数のスコットリストとして返す
+             * @return まだ読み込まれていない入力
+             * @detail 最初のひと塊だけをその場で読み込み、続きはそれを分解し終えたときに読み込む。
+             */
+            expression read()
+            {
+                _out.flush();
+                unsigned char buffer[buffer_size];
+                ssize_t n;
+                while ((n = ::read(_in, buffer, sizeof(buffer))) < 0) {
+                    if (errno != EINTR) {
+                        throw std::system_error(errno, std::generic_category(), "lambda::io::byte_stream::read");
+                    }
+                }
+                if (n == 0) {
+                    return combinators::empty_list;
+                }
+                auto self = shared_from_this();
+                expression l = expression([self](expression) { return self->read(); })(combinators::I);
+                for (ssize_t i = n; i-- > 0;) {
+                    l = native::pair{church_encode(buffer[i]), l};
+                }
+                return l;
+            }
+
+            /**
+             * @brief 一バイトを出力する
+             * @param[in] byte チャーチ数
+             * @return byte が 256 以上なら出力せずに false
+             */
+            bool write(const expression &byte)
+            {
+                std::size_t value = church_decode(byte);
+                if (value > 0xff) {
+                    return false;
+                }
+                unsigned char b = static_cast<unsigned char>(value);
+                _out.put(&b, 1);
+                return true;
+            }
+
+            /** 溜まった出力を書き出す */
+            void flush()
+            {
+                _out.flush();
+            }
+        };
+
+        /**
+         * @brief 読み込み専用にメモリマップしたファイル
+         */
+        class mapped_file final {
+        private:
+            const unsigned char *_data = nullptr;
+            std::size_t _size = 0;
+            dev_t _device = 0;
+            ino_t _inode = 0;
+
+        public:
+            /**
+             * @param[in] path マップするファイルのパス
+             * @detail 開けなかったときは std::system_error を投げる。
+             */
+            explicit mapped_file(const char *path)
+            {
+                int fd;
+                while ((fd = ::open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+                    if (errno != EINTR) {
+                        throw std::system_error(errno, std::generic_category(), path);
+                    }
+                }
+                struct stat st;
+                if (::fstat(fd, &st) < 0) {
+                    int error = errno;
+                    ::close(fd);
+                    throw std::system_error(error, std::generic_category(), path);
+                }
+                _size = st.st_size;
+                _device = st.st_dev;
+                _inode = st.st_ino;
+                if (_size) {
+                    void *data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (data == MAP_FAILED) {
+                        int error = errno;
+                        ::close(fd);
+                        throw std::system_error(error, std::generic_category(), path);
+                    }
+                    ::madvise(data, _size, MADV_SEQUENTIAL);
+                    _data = static_cast<const unsigned char *>(data);
+                }
+                ::close(fd);
+            }
+
+            mapped_file(const mapped_file &) = delete;
+            mapped_file &operator=(const mapped_file &) = delete;
+
+            ~mapped_file()
+            {
+                if (_data) {
+                    ::munmap(const_cast<unsigned char *>(_data), _size);
+                }
+            }
+
+            const unsigned char *data() const
+            {
+                return _data;
+            }
+
+            std::size_t size() const
+            {
+                return _size;
+            }
+
+            /** st がこのファイルを指していれば true */
+            bool same_file(const struct stat &st) const
+            {
+                return st.st_dev == _device && st.st_ino == _inode;
+            }
+        };
+
+        /**
+         * @brief マップしたファイルに並んだ固定幅のリトルエンディアン整数をスコットリストとして読む
+         * @param[in] file マップしたファイル
+         * @param[in] index 読み始める整数の位置
+         * @return index 番目以降の整数をチャーチ数にしたリスト
+         * @detail 一度にひと塊だけをエンコードし、続きはそれを分解し終えたときにエンコードする。
+         * 末尾の幅に満たない端数は無視する。
+         */
+        template <class Integer>
+        inline expression read_integers(const std::shared_ptr<const mapped_file> &file, std::size_t index)
+        {
+            constexpr std::size_t chunk_size = 1 << 12;
+            std::size_t count = file->size() / sizeof(Integer);
+            if (index >= count) {
+                return combinators::empty_list;
+            }
+            std::size_t last = std::min(index + chunk_size, count);
+            expression l = last == count
+                ? combinators::empty_list
+                : expression([file, last](expression) { return read_integers<Integer>(file, last); })(combinators::I);
+            for (std::size_t i = last; i-- > index;) {
+                const unsigned char *bytes = file->data() + i * sizeof(Integer);
+                Integer value = 0;
+                for (std::size_t b = 0; b < sizeof(Integer); ++b) {
+                    value |= static_cast<Integer>(bytes[b]) << (CHAR_BIT * b);
+                }
+                l = native::pair{church_encode(value), l};
+            }
+            return l;
+        }
+    }
+
+    /**
+     * @brief バイト列に対しラムダ計算によるプログラムを実行する
+     * @param[in] in 入力のファイル記述子
+     * @param[in] program 実行するラムダ式
+     * @param[in] out 出力のファイル記述子
+     * @detail in から読み込んだ各バイトをチャーチ数にしてスコットリストにまとめ、program に与える。
+     * 入力は program が分解するたびに読み進めるので、終端を待たずに処理が始まる。
+     * 結果のリストは要素が分かったそばから out に書き出し、256 以上の要素が現れたらそこで打ち切る。
+     * 読み込みと書き出しはバッファを介して大きな単位で行う。
+     * 入出力に失敗したときは std::system_error を投げる。
+     */
+    inline void run_on_byte_stream(int in, expression program, int out)
+    {
+        auto stream = std::make_shared<io::byte_stream>(in, out);
+        /* 入力の先頭を一時オブジェクトに残すと読み終えたセルが解放されないので、式を分けて手放す */
+        expression input = stream->read();
+        expression output = program(std::move(input));
+        native::drain(std::move(output), [&stream](const expression &x) {
+            return stream->write(x);
+        });
+        stream->flush();
+    }
+
+    /**
+     * @brief 整数のファイルに対しラムダ計算によるプログラムを実行する
+     * @tparam Integer ファイルに並んだ整数の型。固定幅の符号なし整数であること
+     * @param[in] input 入力ファイルのパス
+     * @param[in] program 実行するラムダ式
+     * @param[in] output 出力ファイルのパス。なければ作り、あれば切り詰める。input と同じファイルであってはならない
+     * @detail run_on_integer_sequence と同じことを、リトルエンディアンの Integer が並んだファイルに対して行う。
+     * 入力ファイルはメモリマップし、program が分解するのに合わせて少しずつチャーチ数にする。
+     * 結果は要素が分かったそばからバッファを介して出力ファイルへ書き出し、Integer に収まらない上位の桁は捨てる。
+     * どちらの側でも全体を配列にまとめることはない。
+     * 入出力に失敗したときは std::system_error を、output が input と同じファイルのときは
+     * 読んでいる最中の入力を切り詰めないよう、何も書き換えずに std::invalid_argument を投げる。
+     */
+    template <class Integer>
+    inline void run_on_integer_file(const char *input, expression program, const char *output)
+    {
+        static_assert(std::is_integral_v<Integer> && std::is_unsigned_v<Integer>, "Integer must be an unsigned integer type");
+        auto file = std::make_shared<const io::mapped_file>(input);
+        int fd;
+        /* 同じファイルかどうかを確かめてから切り詰めるので、開くときには切り詰めない */
+        while ((fd = ::open(output, O_WRONLY | O_CREAT | O_CLOEXEC, 0666)) < 0) {
+            if (errno != EINTR) {
+                throw std::system_error(errno, std::generic_category(), output);
+            }
+        }
+        try {
+            struct stat st;
+            if (::fstat(fd, &st) < 0) {
+                throw std::system_error(errno, std::generic_category(), output);
+            }
+            if (file->same_file(st)) {
+                throw std::invalid_argument("lambda::run_on_integer_file: the input and the output are the same file");
+            }
+            if (::ftruncate(fd, 0) < 0) {
+                throw std::system_error(errno, std::generic_category(), output);
+            }
+            io::output_buffer out(fd);
+            expression input = io::read_integers<Integer>(file, 0);
+            expression output = program(std::move(input));
+            native::drain(std::move(output), [&out](const expression &x) {
+                std::size_t value = church_decode(x);
+                unsigned char bytes[sizeof(Integer)];
+                for (std::size_t b = 0; b < sizeof(Integer); ++b) {
+                    bytes[b] = static_cast<unsigned char>(value >> (CHAR_BIT * b));
+                }
+                out.put(bytes, sizeof(Integer));
+                return true;
+            });
+            out.flush();
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        if (::close(fd) < 0) {
+            throw std::system_error(errno, std::generic_category(), output);
+        }
+    }
+}
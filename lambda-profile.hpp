@@ -0,0 +1,234 @@
+/**
+ * @file lambda-profile.hpp
+ * @brief ラムダ式の評価にかかった費用を、そのラムダ式を作ったソースコード上の場所ごとに集計します。
+ * @detail LAMBDA_PROFILE を定義してコンパイルしたときだけ計測される。定義しなければ費用はかからない。
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace lambda {
+    class expression;
+
+    namespace profile {
+        /**
+         * @brief エンジンがその正体を見分ける必要のある関数か
+         * @detail ネイティブ表現は包むと見分けられなくなるので、場所を記録しない。
+         */
+        template <class T>
+        struct is_native : std::false_type {
+        };
+
+        /** 呼び出しの木の節。根からの経路が呼び出しの入れ子に対応する */
+        struct node {
+            const char *file;
+            unsigned line;
+            std::vector<std::unique_ptr<node>> children;
+            std::size_t calls = 0;
+            std::size_t allocations = 0;
+            std::chrono::nanoseconds total{0};
+
+            node(const char *file, unsigned line)
+                : file(file), line(line)
+            {
+            }
+
+            node *child(const char *f, unsigned l)
+            {
+                for (auto &c : children) {
+                    if (c->line == l && c->file == f) {
+                        return c.get();
+                    }
+                }
+                children.push_back(std::make_unique<node>(f, l));
+                return children.back().get();
+            }
+        };
+
+        /** スレッドごとの呼び出しの木 */
+        struct thread_state {
+            node root{nullptr, 0};
+            node *current = &root;
+        };
+
+        /** 計測中であれば true */
+        inline std::atomic<bool> enabled = false;
+
+        inline std::mutex threads_mutex;
+
+        /** これまでに計測したすべてのスレッドの木。スレッドが終わっても集計できるよう共有する */
+        inline std::vector<std::shared_ptr<thread_state>> threads;
+
+        inline thread_state &local()
+        {
+            thread_local std::shared_ptr<thread_state> s = [] {
+                auto s = std::make_shared<thread_state>();
+                std::lock_guard<std::mutex> lock(threads_mutex);
+                threads.push_back(s);
+                return s;
+            }();
+            return *s;
+        }
+
+        /**
+         * @brief 場所を一つ入れ子にして、抜けるまでの時間を計上する
+         * @detail 評価を中断する task と組み合わせると、同じスレッドで交互に進む評価の入れ子が混ざる。
+         */
+        class scope final {
+        private:
+            using clock = std::chrono::steady_clock;
+            node *_node = nullptr;
+            node *_parent = nullptr;
+            clock::time_point _start;
+
+        public:
+            scope(const char *file, unsigned line)
+            {
+                if (!enabled.load(std::memory_order_relaxed)) {
+                    return;
+                }
+                thread_state &s = local();
+                _parent = s.current;
+                _node = _parent->child(file, line);
+                ++_node->calls;
+                s.current = _node;
+                _start = clock::now();
+            }
+
+            scope(const scope &) = delete;
+            scope &operator=(const scope &) = delete;
+
+            ~scope()
+            {
+                if (_node) {
+                    _node->total += clock::now() - _start;
+                    local().current = _parent;
+                }
+            }
+        };
+
+        /** サンクを一つ確保したことを、いま入れ子の最も内側にある場所に計上する */
+        inline void allocated()
+        {
+            if (enabled.load(std::memory_order_relaxed)) {
+                ++local().current->allocations;
+            }
+        }
+
+        /**
+         * @brief 作られた場所を覚えた関数
+         * @tparam F 包む関数の型
+         */
+        template <class F>
+        struct located {
+            F function;
+            const char *file;
+            unsigned line;
+
+            template <class Expression>
+            Expression operator()(Expression x) const
+            {
+                scope s(file, line);
+                if constexpr (std::is_same_v<decltype(function(std::move(x))), Expression>) {
+                    return function(std::move(x));
+                } else {
+                    /* 関数本体が返したラムダはここで初めてラムダ式になるので、それを定義した外側の場所を添える */
+                    return Expression(function(std::move(x)), file, line);
+                }
+            }
+        };
+
+        /** 計測を始める */
+        inline void start()
+        {
+            enabled = true;
+        }
+
+        /** 計測をやめる。集計した値は残る */
+        inline void stop()
+        {
+            enabled = false;
+        }
+
+        /** 集計した値をすべて 0 に戻す。評価が行われていないときに呼び出すこと */
+        inline void reset()
+        {
+            std::lock_guard<std::mutex> lock(threads_mutex);
+            for (auto &t : threads) {
+                std::vector<node *> stack{&t->root};
+                while (!stack.empty()) {
+                    node *n = stack.back();
+                    stack.pop_back();
+                    n->calls = n->allocations = 0;
+                    n->total = std::chrono::nanoseconds(0);
+                    for (auto &c : n->children) {
+                        stack.push_back(c.get());
+                    }
+                }
+            }
+        }
+
+        /** 集計する値の種類 */
+        enum class metric {
+            time,       /**< その場所自身で費やした時間 (ナノ秒)。内側の場所で費やした時間は含まない */
+            calls,      /**< その場所で作られた関数が適用された回数 */
+            allocations /**< その場所が最も内側にある間に確保されたサンクの数 */
+        };
+
+        /**
+         * @brief 集計結果を flamegraph.pl などが読める folded stacks 形式で書き出す
+         * @param[out] out 出力先
+         * @param[in] m 集計する値の種類
+         * @detail 一行ごとに「ファイル:行;ファイル:行;... 値」の形で、呼び出しの経路とその値を書き出す。
+         * 組み込みのコンビネータの本体は、場所の代わりにその名前で書き出す。
+         * すべてのスレッドの木を経路ごとに足し合わせる。評価が行われていないときに呼び出すこと。
+         */
+        inline void folded(std::ostream &out, metric m = metric::time)
+        {
+            std::map<std::string, std::size_t> totals;
+            std::lock_guard<std::mutex> lock(threads_mutex);
+            for (auto &t : threads) {
+                std::vector<std::pair<const node *, std::string>> stack{{&t->root, std::string()}};
+                while (!stack.empty()) {
+                    auto [n, path] = std::move(stack.back());
+                    stack.pop_back();
+                    std::size_t value = 0;
+                    if (m == metric::time) {
+                        auto self = n->total;
+                        for (auto &c : n->children) {
+                            self -= c->total;
+                        }
+                        value = n->file ? std::max<std::chrono::nanoseconds::rep>(self.count(), 0) : 0;
+                    } else {
+                        value = m == metric::calls ? n->calls : n->allocations;
+                    }
+                    if (value) {
+                        totals[path.empty() ? "[outside]" : path] += value;
+                    }
+                    for (auto &c : n->children) {
+                        std::string name = c->file;
+                        if (c->line) {
+                            name = name.substr(name.find_last_of('/') + 1) + ':' + std::to_string(c->line);
+                        }
+                        stack.push_back({c.get(), path.empty() ? name : path + ';' + name});
+                    }
+                }
+            }
+            for (const auto &[path, value] : totals) {
+                out << path << ' ' << value << '\n';
+            }
+        }
+    }
+}
@@ -0,0 +1,376 @@
+/**
+ * @file lambda-scheduler.hpp
+ * @brief 多数の評価を決まった数のワーカースレッドで公平に実行します。
+ */
+
+#pragma once
+
+#include "lambda-task.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace lambda {
+    /**
+     * @brief 評価の仕事をテナントごとに公平に割り振るスケジューラ
+     * @detail 各仕事は task として実行され、決まった段数の簡約ごとに中断して次の仕事に順番を譲る。
+     * 次に進める仕事は、優先度の高いものから、これまでに使った簡約の段数を重みで割った値が最も小さいテナントのものを選ぶ。
+     * ただし、ほかの評価が使っているサンクの結果を待って中断した仕事は、ほかに進められる仕事があればそちらを先にする。
+     * 待たれているサンクを評価している仕事が同じワーカーで中断していても、それが再開されないまま待ち続けることはない。
+     * 仕事は投入時にいずれかのワーカーに割り当てられ、手の空いたワーカーはまだ始まっていない仕事をほかのワーカーから奪う。
+     * 走り出した仕事は最初に実行したワーカーで最後まで実行する。
+     */
+    class scheduler final {
+    public:
+        /** 投入した仕事の受付票 */
+        struct ticket {
+            /** 仕事の番号 */
+            std::size_t id;
+
+            /** 仕事が終わると準備完了になる。仕事が投げた例外もここから受け取れる */
+            std::future<void> finished;
+        };
+
+        /** 簡約の段数の上限を超えて打ち切られた仕事の future に設定される */
+        struct budget_exceeded : std::runtime_error {
+            /** 打ち切られる直前にその仕事で行われた簡約の記録。LAMBDA_TRACE を定義していなければ空 */
+            std::vector<trace::event> trace;
+
+            explicit budget_exceeded(std::vector<trace::event> trace = {})
+                : std::runtime_error("lambda::scheduler: step budget exceeded"), trace(std::move(trace))
+            {
+            }
+        };
+
+        /** 実行中の仕事の様子 */
+        struct job_statistics {
+            std::size_t id;
+            std::string tenant;
+            int priority;
+            bool started;
+            std::size_t steps;
+        };
+
+        /** スケジューラ全体の様子 */
+        struct statistics {
+            /** まだ始まっていない仕事の数 */
+            std::size_t queued;
+
+            /** 始まっていてまだ終わっていない仕事の数 */
+            std::size_t running;
+
+            /** 終わった仕事の数 */
+            std::size_t completed;
+
+            /** 終わっていない各仕事の様子。段数は直前の区切りでの値 */
+            std::vector<job_statistics> jobs;
+
+            /** 最近終わった仕事の、投入から終了までにかかった時間の 50, 90, 99 パーセンタイル */
+            std::chrono::nanoseconds p50, p90, p99;
+        };
+
+    private:
+        using clock = std::chrono::steady_clock;
+
+        struct tenant {
+            std::size_t weight = 1;
+            std::size_t max_running = 0;
+            std::size_t running = 0;
+            std::size_t used_steps = 0;
+        };
+
+        struct job {
+            std::size_t id;
+            std::string tenant_name;
+            tenant *owner;
+            int priority;
+            std::size_t budget;
+            clock::time_point submitted;
+            std::promise<void> promise;
+            lambda::task work;
+            bool started = false;
+            /** 直前の区切りまでに行った簡約の段数 */
+            std::size_t reported_steps = 0;
+            /** 直前の中断がサンクの結果を待つためのものであれば true */
+            bool waiting = false;
+
+            job(std::function<void()> body, std::size_t stack_size)
+                : work(std::move(body), stack_size)
+            {
+            }
+        };
+
+        struct worker {
+            std::deque<std::shared_ptr<job>> jobs;
+            std::shared_ptr<job> current;
+            std::thread thread;
+        };
+
+        static constexpr std::size_t latency_samples = 1024;
+
+        std::size_t _slice;
+        std::size_t _stack_size;
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        bool _stopping = false;
+        std::size_t _next_id = 0;
+        std::size_t _next_worker = 0;
+        std::size_t _completed = 0;
+        std::map<std::string, tenant> _tenants;
+        std::vector<worker> _workers;
+        std::vector<std::chrono::nanoseconds> _latencies;
+        std::size_t _latency_cursor = 0;
+
+        /** まだ始まっていない仕事を始めてよいか */
+        static bool admissible(const job &j)
+        {
+            return j.started || !j.owner->max_running || j.owner->running < j.owner->max_running;
+        }
+
+        /** a を b より先に進めるべきか */
+        static bool before(const job &a, const job &b)
+        {
+            if (a.waiting != b.waiting) {
+                /* 待っている仕事を先に進めても、すぐにまた中断するだけである */
+                return !a.waiting;
+            }
+            if (a.priority != b.priority) {
+                return a.priority > b.priority;
+            }
+            /* used_steps / weight の比較を掛け算で行う */
+            return a.owner->used_steps * b.owner->weight < b.owner->used_steps * a.owner->weight;
+        }
+
+        /**
+         * @brief 次に進める仕事を選んで取り出す
+         * @param[in] self 選ぶワーカーの番号
+         * @return 選んだ仕事。なければ nullptr
+         */
+        std::shared_ptr<job> pick(std::size_t self)
+        {
+            auto best = [this](std::deque<std::shared_ptr<job>> &jobs, bool unstarted_only) {
+                auto chosen = jobs.end();
+                for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+                    if ((unstarted_only && (*it)->started) || !admissible(**it)) {
+                        continue;
+                    }
+                    if (chosen == jobs.end() || before(**it, **chosen)) {
+                        chosen = it;
+                    }
+                }
+                return chosen;
+            };
+            auto &own = _workers[self].jobs;
+            if (auto it = best(own, false); it != own.end()) {
+                auto j = std::move(*it);
+                own.erase(it);
+                return j;
+            }
+            for (std::size_t k = 1; k < _workers.size(); ++k) {
+                auto &other = _workers[(self + k) % _workers.size()].jobs;
+                if (auto it = best(other, true); it != other.end()) {
+                    auto j = std::move(*it);
+                    other.erase(it);
+                    return j;
+                }
+            }
+            return nullptr;
+        }
+
+        void record_latency(std::chrono::nanoseconds latency)
+        {
+            if (_latencies.size() < latency_samples) {
+                _latencies.push_back(latency);
+            } else {
+                _latencies[_latency_cursor] = latency;
+                _latency_cursor = (_latency_cursor + 1) % latency_samples;
+            }
+        }
+
+        /** 仕事を終えたものとして片付ける */
+        void finish(job &j, std::exception_ptr error)
+        {
+            if (j.started) {
+                --j.owner->running;
+            }
+            ++_completed;
+            record_latency(clock::now() - j.submitted);
+            if (error) {
+                j.promise.set_exception(error);
+            } else {
+                j.promise.set_value();
+            }
+            /* ほかのワーカーが同じテナントの仕事を始められるようになったかもしれない */
+            _wake.notify_all();
+        }
+
+        void run(std::size_t self)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (;;) {
+                std::shared_ptr<job> j;
+                _wake.wait(lock, [&] { return _stopping || (j = pick(self)); });
+                if (!j) {
+                    break;
+                }
+                if (!j->started) {
+                    j->started = true;
+                    ++j->owner->running;
+                }
+                std::size_t before_steps = j->work.steps();
+                std::size_t slice = _slice;
+                if (j->budget) {
+                    /* 上限をちょうど一段超えたところで止まるようにする */
+                    std::size_t remaining = j->budget - before_steps + 1;
+                    slice = slice ? std::min(slice, remaining) : remaining;
+                }
+                _workers[self].current = j;
+                lock.unlock();
+                bool done = false;
+                std::exception_ptr error;
+                try {
+                    done = j->work.resume(slice);
+                } catch (...) {
+                    done = true;
+                    error = std::current_exception();
+                }
+                std::size_t used = j->work.steps() - before_steps;
+                if (!done && j->budget && j->work.steps() > j->budget) {
+                    /* 中断中の評価はこのスレッドで巻き戻す */
+                    j->work.cancel();
+                    done = true;
+                    error = std::make_exception_ptr(budget_exceeded(j->work.trace_events()));
+                }
+                lock.lock();
+                _workers[self].current = nullptr;
+                j->owner->used_steps += used;
+                j->reported_steps += used;
+                j->waiting = !done && j->work.waiting();
+                if (done) {
+                    finish(*j, error);
+                } else {
+                    _workers[self].jobs.push_back(std::move(j));
+                }
+            }
+            /* 止めるときは、このワーカーが抱えている仕事をこのスレッドで巻き戻して捨てる */
+            auto jobs = std::move(_workers[self].jobs);
+            lock.unlock();
+            jobs.clear();
+        }
+
+    public:
+        /**
+         * @param[in] workers ワーカースレッドの数
+         * @param[in] slice 一度に進める簡約の段数
+         * @param[in] stack_size 各仕事に用意するスタックの大きさ
+         */
+        explicit scheduler(std::size_t workers = std::max(1u, std::thread::hardware_concurrency()), std::size_t slice = 10000, std::size_t stack_size = 8 << 20)
+            : _slice(slice), _stack_size(stack_size), _workers(std::max<std::size_t>(workers, 1))
+        {
+            for (std::size_t i = 0; i < _workers.size(); ++i) {
+                _workers[i].thread = std::thread(&scheduler::run, this, i);
+            }
+        }
+
+        scheduler(const scheduler &) = delete;
+        scheduler &operator=(const scheduler &) = delete;
+
+        /**
+         * @detail 終わっていない仕事は打ち切られ、その future は std::future_error を投げるようになる。
+         */
+        ~scheduler()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stopping = true;
+            }
+            _wake.notify_all();
+            for (auto &w : _workers) {
+                w.thread.join();
+            }
+        }
+
+        /**
+         * @brief テナントの割り当てを設定する
+         * @param[in] name テナントの名前
+         * @param[in] weight 簡約の段数の取り分の重み
+         * @param[in] max_running 同時に走らせてよい仕事の数。0 なら制限しない
+         */
+        void set_tenant(const std::string &name, std::size_t weight, std::size_t max_running = 0)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            tenant &t = _tenants[name];
+            t.weight = std::max<std::size_t>(weight, 1);
+            t.max_running = max_running;
+            _wake.notify_all();
+        }
+
+        /**
+         * @brief 仕事を投入する
+         * @param[in] tenant_name 仕事を投入するテナントの名前
+         * @param[in] body 評価する処理
+         * @param[in] priority 優先度。大きいほど先に進める
+         * @param[in] budget 簡約の段数の上限。0 なら制限しない
+         * @return 受付票
+         */
+        ticket submit(const std::string &tenant_name, std::function<void()> body, int priority = 0, std::size_t budget = 0)
+        {
+            auto j = std::make_shared<job>(std::move(body), _stack_size);
+            j->priority = priority;
+            j->budget = budget;
+            j->tenant_name = tenant_name;
+            j->submitted = clock::now();
+            std::future<void> finished = j->promise.get_future();
+            std::lock_guard<std::mutex> lock(_mutex);
+            j->id = _next_id++;
+            j->owner = &_tenants[tenant_name];
+            std::size_t id = j->id;
+            _workers[_next_worker++ % _workers.size()].jobs.push_back(std::move(j));
+            _wake.notify_all();
+            return {id, std::move(finished)};
+        }
+
+        /**
+         * @brief 現在の様子を調べる
+         * @return 調べた結果
+         */
+        statistics stats()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            statistics s{0, 0, _completed, {}, {}, {}, {}};
+            auto add = [&s](const job &j) {
+                ++(j.started ? s.running : s.queued);
+                s.jobs.push_back({j.id, j.tenant_name, j.priority, j.started, j.reported_steps});
+            };
+            for (const auto &w : _workers) {
+                for (const auto &j : w.jobs) {
+                    add(*j);
+                }
+                if (w.current) {
+                    add(*w.current);
+                }
+            }
+            std::vector<std::chrono::nanoseconds> sorted = _latencies;
+            std::sort(sorted.begin(), sorted.end());
+            auto percentile = [&sorted](std::size_t p) {
+                return sorted.empty() ? std::chrono::nanoseconds(0) : sorted[(sorted.size() - 1) * p / 100];
+            };
+            s.p50 = percentile(50);
+            s.p90 = percentile(90);
+            s.p99 = percentile(99);
+            return s;
+        }
+    };
+}
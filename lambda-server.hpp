@@ -0,0 +1,507 @@
+/**
+ * @file lambda-server.hpp
+ * @brief 名前を付けたラムダ計算によるプログラムを常駐させ、Unix ドメインソケット越しに評価を受け付けます。
+ */
+
+#pragma once
+
+#include "lambda-expression.hpp"
+#include "lambda-scheduler.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace lambda {
+    /**
+     * @brief サーバとクライアントの間でやり取りするフレームの形式
+     * @detail フレームはリトルエンディアン 4 バイトの長さに続く本体からなり、本体の整数はすべて LEB128 で表す。
+     * 要求の本体は、プログラム名の長さ、プログラム名、入力の要素数、各要素を並べたもの。
+     * 応答の本体は、状態を表す 1 バイトに続けて、成功なら結果の要素数と各要素を、失敗ならメッセージの長さとメッセージを並べたもの。
+     */
+    namespace protocol {
+        /** 応答の状態 */
+        enum class status : unsigned char {
+            ok,
+            unknown_program,
+            failed
+        };
+
+        /** これより長いフレームは壊れているものとして扱う */
+        static constexpr std::size_t max_frame = 1 << 26;
+
+        inline void put(std::string &out, std::size_t n)
+        {
+            for (; n >= 0x80; n >>= 7) {
+                out.push_back(static_cast<char>((n & 0x7f) | 0x80));
+            }
+            out.push_back(static_cast<char>(n));
+        }
+
+        inline void put(std::string &out, const std::string &s)
+        {
+            put(out, s.size());
+            out += s;
+        }
+
+        /**
+         * @brief フレームの本体を先頭から読む
+         */
+        class cursor {
+        private:
+            const std::string &_data;
+            std::size_t _position = 0;
+
+        public:
+            explicit cursor(const std::string &data)
+                : _data(data)
+            {
+            }
+
+            /** 整数を読む。読めなければ std::runtime_error を投げる */
+            std::size_t get()
+            {
+                std::size_t n = 0;
+                for (unsigned shift = 0;; shift += 7) {
+                    if (_position == _data.size() || shift >= sizeof(std::size_t) * 8) {
+                        throw std::runtime_error("lambda::protocol: malformed frame");
+                    }
+                    unsigned char b = _data[_position++];
+                    n |= static_cast<std::size_t>(b & 0x7f) << shift;
+                    if (!(b & 0x80)) {
+                        return n;
+                    }
+                }
+            }
+
+            /** 長さの付いた文字列を読む */
+            std::string text()
+            {
+                std::size_t n = get();
+                if (n > _data.size() - _position) {
+                    throw std::runtime_error("lambda::protocol: malformed frame");
+                }
+                std::string s = _data.substr(_position, n);
+                _position += n;
+                return s;
+            }
+
+            /** 要素数の付いた整数の列を読む */
+            std::vector<std::size_t> numbers()
+            {
+                std::size_t n = get();
+                if (n > _data.size() - _position) {
+                    throw std::runtime_error("lambda::protocol: malformed frame");
+                }
+                std::vector<std::size_t> v(n);
+                for (auto &x : v) {
+                    x = get();
+                }
+                return v;
+            }
+
+            unsigned char byte()
+            {
+                if (_position == _data.size()) {
+                    throw std::runtime_error("lambda::protocol: malformed frame");
+                }
+                return _data[_position++];
+            }
+        };
+
+        /**
+         * @brief フレームを一つ送る
+         * @param[in] fd ソケット
+         * @param[in] body フレームの本体
+         * @detail 失敗したときは std::system_error を投げる。
+         */
+        inline void send_frame(int fd, const std::string &body)
+        {
+            std::string frame(4, '\0');
+            for (std::size_t b = 0; b < 4; ++b) {
+                frame[b] = static_cast<char>(body.size() >> (8 * b));
+            }
+            frame += body;
+            const char *p = frame.data();
+            std::size_t left = frame.size();
+            while (left) {
+                ssize_t n = ::send(fd, p, left, MSG_NOSIGNAL);
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::system_error(errno, std::generic_category(), "lambda::protocol::send_frame");
+                }
+                p += n;
+                left -= n;
+            }
+        }
+
+        /**
+         * @brief フレームを一つ受け取る
+         * @param[in] fd ソケット
+         * @param[out] body フレームの本体
+         * @return 受け取れたら true、フレームの切れ目で相手が閉じたら false
+         * @detail 途中で閉じられたり失敗したりしたときは std::system_error を、長すぎるフレームには std::runtime_error を投げる。
+         */
+        inline bool receive_frame(int fd, std::string &body)
+        {
+            auto receive = [fd](char *p, std::size_t left, bool eof_allowed) {
+                bool first = true;
+                while (left) {
+                    ssize_t n = ::recv(fd, p, left, 0);
+                    if (n < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        throw std::system_error(errno, std::generic_category(), "lambda::protocol::receive_frame");
+                    }
+                    if (n == 0) {
+                        if (first && eof_allowed) {
+                            return false;
+                        }
+                        throw std::system_error(ECONNRESET, std::generic_category(), "lambda::protocol::receive_frame");
+                    }
+                    first = false;
+                    p += n;
+                    left -= n;
+                }
+                return true;
+            };
+            unsigned char header[4];
+            if (!receive(reinterpret_cast<char *>(header), 4, true)) {
+                return false;
+            }
+            std::size_t size = 0;
+            for (std::size_t b = 0; b < 4; ++b) {
+                size |= static_cast<std::size_t>(header[b]) << (8 * b);
+            }
+            if (size > max_frame) {
+                throw std::runtime_error("lambda::protocol: frame too large");
+            }
+            body.resize(size);
+            receive(&body[0], size, false);
+            return true;
+        }
+
+        /**
+         * @brief パスに結び付いた Unix ドメインソケットのアドレスを作る
+         * @param[in] path パス
+         * @return アドレス
+         */
+        inline sockaddr_un address(const std::string &path)
+        {
+            sockaddr_un a = {};
+            a.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(a.sun_path)) {
+                throw std::invalid_argument("lambda::protocol: socket path too long");
+            }
+            std::memcpy(a.sun_path, path.c_str(), path.size() + 1);
+            return a;
+        }
+    }
+
+    /**
+     * @brief 名前を付けたプログラムを常駐させて評価を受け付けるサーバ
+     * @detail 起動時に読み込んだプログラムを弱頭部正規形まで評価しておき、以降の要求はすべてそれを共有する。
+     * 接続ごとに一つのスレッドが要求を順に読み、評価は scheduler のワーカーで行う。
+     * テナントはプログラム名とするので、重いプログラムへの要求が続いてもほかのプログラムへの要求は待たされ続けない。
+     * @code
+     * lambda::server s;
+     * s.add("double", map(mult(church_encode(2))));
+     * s.start("/tmp/lambda.sock");
+     * // ...
+     * s.stop();
+     * @endcode
+     */
+    class server final {
+    private:
+        /** 評価中の要求。接続が先に閉じられても評価が参照し続けられるよう共有する */
+        struct job {
+            std::vector<std::size_t> input;
+            std::vector<std::size_t> output;
+        };
+
+        struct connection {
+            int fd;
+            std::thread thread;
+            std::atomic<bool> finished = false;
+        };
+
+        std::map<std::string, expression> _programs;
+        std::size_t _budget;
+        lambda::scheduler _pool;
+        int _listener = -1;
+        std::string _path;
+        std::thread _acceptor;
+        std::mutex _mutex;
+        std::vector<std::unique_ptr<connection>> _connections;
+        std::atomic<bool> _stopping = false;
+
+        /**
+         * @brief 要求を一つ処理して応答の本体を作る
+         * @param[in] request 要求の本体
+         * @return 応答の本体
+         */
+        std::string handle(const std::string &request)
+        {
+            protocol::cursor in(request);
+            std::string name = in.text();
+            auto j = std::make_shared<job>();
+            j->input = in.numbers();
+            std::string response;
+            auto it = _programs.find(name);
+            if (it == _programs.end()) {
+                response.push_back(static_cast<char>(protocol::status::unknown_program));
+                protocol::put(response, "unknown program: " + name);
+                return response;
+            }
+            expression program = it->second;
+            auto ticket = _pool.submit(
+                name, [j, program] {
+                    run_on_integer_sequence(j->input.begin(), j->input.end(), program, std::back_inserter(j->output));
+                },
+                0, _budget);
+            while (ticket.finished.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready) {
+                if (_stopping) {
+                    throw std::runtime_error("lambda::server: stopping");
+                }
+            }
+            try {
+                ticket.finished.get();
+            } catch (const std::exception &e) {
+                response.push_back(static_cast<char>(protocol::status::failed));
+                protocol::put(response, std::string(e.what()));
+                return response;
+            }
+            response.push_back(static_cast<char>(protocol::status::ok));
+            protocol::put(response, j->output.size());
+            for (std::size_t x : j->output) {
+                protocol::put(response, x);
+            }
+            return response;
+        }
+
+        void serve(connection &c)
+        {
+            try {
+                std::string request;
+                while (!_stopping && protocol::receive_frame(c.fd, request)) {
+                    protocol::send_frame(c.fd, handle(request));
+                }
+            } catch (...) {
+                /* 壊れたフレームや切れた接続はその接続だけを閉じる */
+            }
+            c.finished = true;
+        }
+
+        /** 終わった接続を片付ける。_mutex を握って呼び出すこと */
+        void collect()
+        {
+            for (auto it = _connections.begin(); it != _connections.end();) {
+                if ((*it)->finished) {
+                    (*it)->thread.join();
+                    ::close((*it)->fd);
+                    it = _connections.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        void accept_loop()
+        {
+            while (!_stopping) {
+                int fd = ::accept4(_listener, nullptr, nullptr, SOCK_CLOEXEC);
+                if (fd < 0) {
+                    if (errno == EINTR || errno == ECONNABORTED) {
+                        continue;
+                    }
+                    break;
+                }
+                std::lock_guard<std::mutex> lock(_mutex);
+                collect();
+                if (_stopping) {
+                    ::close(fd);
+                    break;
+                }
+                auto c = std::make_unique<connection>();
+                c->fd = fd;
+                c->thread = std::thread(&server::serve, this, std::ref(*c));
+                _connections.push_back(std::move(c));
+            }
+        }
+
+    public:
+        /**
+         * @param[in] workers 評価を行うワーカースレッドの数
+         * @param[in] budget 一つの要求に許す簡約の段数。0 なら制限しない
+         */
+        explicit server(std::size_t workers = std::max(1u, std::thread::hardware_concurrency()), std::size_t budget = 0)
+            : _budget(budget), _pool(workers)
+        {
+        }
+
+        server(const server &) = delete;
+        server &operator=(const server &) = delete;
+
+        ~server()
+        {
+            stop();
+        }
+
+        /**
+         * @brief プログラムを読み込む
+         * @param[in] name 要求で指定する名前
+         * @param[in] program スコットリストを受け取りスコットリストを返すラムダ式
+         * @detail start より前に呼び出すこと。program はここで弱頭部正規形まで評価しておく。
+         */
+        void add(const std::string &name, expression program)
+        {
+            whnf(program);
+            _programs[name] = std::move(program);
+        }
+
+        /**
+         * @brief 要求の受け付けを始める
+         * @param[in] path ソケットのパス。既にあれば置き換える
+         * @detail 失敗したときは std::system_error を投げる。stop したあとで呼び出すと受け付けを再開する。
+         * 受け付けている最中に呼び出すと std::logic_error を投げる。
+         */
+        void start(const std::string &path)
+        {
+            if (_listener >= 0) {
+                throw std::logic_error("lambda::server::start: already started");
+            }
+            sockaddr_un a = protocol::address(path);
+            int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                throw std::system_error(errno, std::generic_category(), "lambda::server::start");
+            }
+            ::unlink(path.c_str());
+            if (::bind(fd, reinterpret_cast<sockaddr *>(&a), sizeof(a)) < 0 || ::listen(fd, SOMAXCONN) < 0) {
+                int error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), path);
+            }
+            _listener = fd;
+            _path = path;
+            /* 前回の stop で止めたスレッドはすべて合流済みなので、ここで戻してよい */
+            _stopping = false;
+            _acceptor = std::thread(&server::accept_loop, this);
+        }
+
+        /**
+         * @brief 要求の受け付けをやめ、すべての接続を閉じる
+         * @detail 評価中の要求には応答しない。もう一度 start を呼び出せば受け付けを再開できる。
+         */
+        void stop()
+        {
+            if (_listener < 0) {
+                return;
+            }
+            _stopping = true;
+            ::shutdown(_listener, SHUT_RDWR);
+            _acceptor.join();
+            ::close(_listener);
+            ::unlink(_path.c_str());
+            _listener = -1;
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (auto &c : _connections) {
+                ::shutdown(c->fd, SHUT_RDWR);
+            }
+            for (auto &c : _connections) {
+                c->thread.join();
+                ::close(c->fd);
+            }
+            _connections.clear();
+        }
+    };
+
+    /**
+     * @brief server に評価を頼むクライアント
+     */
+    class client final {
+    private:
+        int _fd;
+
+    public:
+        /**
+         * @param[in] path サーバのソケットのパス
+         * @detail 接続できなかったときは std::system_error を投げる。
+         */
+        explicit client(const std::string &path)
+        {
+            sockaddr_un a = protocol::address(path);
+            _fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (_fd < 0) {
+                throw std::system_error(errno, std::generic_category(), "lambda::client");
+            }
+            while (::connect(_fd, reinterpret_cast<sockaddr *>(&a), sizeof(a)) < 0) {
+                if (errno != EINTR) {
+                    int error = errno;
+                    ::close(_fd);
+                    throw std::system_error(error, std::generic_category(), path);
+                }
+            }
+        }
+
+        client(const client &) = delete;
+        client &operator=(const client &) = delete;
+
+        ~client()
+        {
+            ::close(_fd);
+        }
+
+        /**
+         * @brief サーバに読み込まれたプログラムを自然数の列に対して実行する
+         * @param[in] program プログラムの名前
+         * @param[in] input 入力の自然数の列
+         * @return 結果の自然数の列
+         * @detail 名前が見つからなければ std::invalid_argument を、評価に失敗したら std::runtime_error を、
+         * 通信に失敗したら std::system_error を投げる。
+         */
+        std::vector<std::size_t> evaluate(const std::string &program, const std::vector<std::size_t> &input)
+        {
+            std::string request;
+            protocol::put(request, program);
+            protocol::put(request, input.size());
+            for (std::size_t x : input) {
+                protocol::put(request, x);
+            }
+            protocol::send_frame(_fd, request);
+            std::string response;
+            if (!protocol::receive_frame(_fd, response)) {
+                throw std::system_error(ECONNRESET, std::generic_category(), "lambda::client::evaluate");
+            }
+            protocol::cursor in(response);
+            auto s = static_cast<protocol::status>(in.byte());
+            if (s == protocol::status::ok) {
+                return in.numbers();
+            }
+            std::string message = in.text();
+            if (s == protocol::status::unknown_program) {
+                throw std::invalid_argument(message);
+            }
+            throw std::runtime_error(message);
+        }
+    };
+}
@@ -0,0 +1,191 @@
+/**
+ * @file lambda-tally.hpp
+ * @brief 組み込みのコンビネータごとに、適用された回数、確保したサンクの数、費やした時間を数えます。
+ * @detail LAMBDA_TALLY を定義してコンパイルしたときだけ数える。定義しなければ費用はかからない。
+ * lambda-profile.hpp より軽く、場所や呼び出しの入れ子は記録しない。
+ * 実行中のコンビネータはスレッドごとに覚えるが、task はそれを評価ごとに預かるので、
+ * 同じスレッドで交互に進む評価どうしで確保したサンクの数が混ざることはない。
+ * 中断をまたいだコンビネータの時間には、中断していた間も含まれる。
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace lambda {
+    namespace tally {
+        /** 数えられるコンビネータの数の上限 */
+        static constexpr std::size_t max_counters = 64;
+
+        /** 一つのコンビネータの計数 */
+        class counter final {
+        private:
+            static std::vector<counter *> &all()
+            {
+                static std::vector<counter *> counters;
+                return counters;
+            }
+
+        public:
+            const char *name;
+            std::size_t id;
+            std::atomic<std::uint64_t> calls = 0;
+            std::atomic<std::uint64_t> allocations = 0;
+            std::atomic<std::uint64_t> nanoseconds = 0;
+
+            explicit counter(const char *name)
+                : name(name), id(all().size())
+            {
+                if (id >= max_counters) {
+                    throw std::length_error("lambda::tally: too many counters");
+                }
+                all().push_back(this);
+            }
+
+            counter(const counter &) = delete;
+            counter &operator=(const counter &) = delete;
+
+            /** 登録されたすべての計数 */
+            static const std::vector<counter *> &registered()
+            {
+                return all();
+            }
+        };
+
+        /** スレッドごとの、最も内側で実行中のコンビネータと、各コンビネータの入れ子の深さ */
+        struct thread_state {
+            counter *innermost = nullptr;
+            unsigned depth[max_counters] = {};
+        };
+
+        inline thread_state &local()
+        {
+            thread_local thread_state s;
+            return s;
+        }
+
+#ifdef LAMBDA_TALLY
+        /**
+         * @brief コンビネータの本体を実行している間を表す
+         * @detail 同じコンビネータが入れ子になったときは、最も外側の一回分だけ時間を数える。
+         */
+        class scope final {
+        private:
+            using clock = std::chrono::steady_clock;
+            counter &_counter;
+            counter *_outer;
+            clock::time_point _start;
+
+        public:
+            /**
+             * @param[in] c 数えるコンビネータ
+             * @param[in] applied 適用の回数に数えるなら true。引数を受け取る途中の段では false にする
+             */
+            scope(counter &c, bool applied = true)
+                : _counter(c)
+            {
+                thread_state &s = local();
+                if (applied) {
+                    c.calls.fetch_add(1, std::memory_order_relaxed);
+                }
+                _outer = s.innermost;
+                s.innermost = &c;
+                if (s.depth[c.id]++ == 0) {
+                    _start = clock::now();
+                }
+            }
+
+            scope(const scope &) = delete;
+            scope &operator=(const scope &) = delete;
+
+            ~scope()
+            {
+                thread_state &s = local();
+                if (--s.depth[_counter.id] == 0) {
+                    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - _start);
+                    _counter.nanoseconds.fetch_add(elapsed.count(), std::memory_order_relaxed);
+                }
+                s.innermost = _outer;
+            }
+        };
+
+        /** サンクを一つ確保したことを、最も内側で実行中のコンビネータに数える */
+        inline void allocated()
+        {
+            if (counter *c = local().innermost) {
+                c->allocations.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+#else
+        class scope final {
+        public:
+            scope(counter &, bool = true)
+            {
+            }
+        };
+#endif
+
+        /** 一つのコンビネータの集計結果 */
+        struct entry {
+            std::string name;
+            std::uint64_t calls;
+            std::uint64_t allocations;
+            std::chrono::nanoseconds time;
+        };
+
+        /**
+         * @brief 集計結果を得る
+         * @return 費やした時間の長い順に並べた各コンビネータの集計結果。一度も適用されなかったものは含まない
+         */
+        inline std::vector<entry> report()
+        {
+            std::vector<entry> entries;
+            for (const counter *c : counter::registered()) {
+                std::uint64_t calls = c->calls.load(std::memory_order_relaxed);
+                if (calls) {
+                    entries.push_back({c->name, calls, c->allocations.load(std::memory_order_relaxed), std::chrono::nanoseconds(c->nanoseconds.load(std::memory_order_relaxed))});
+                }
+            }
+            std::stable_sort(entries.begin(), entries.end(), [](const entry &a, const entry &b) {
+                return a.time > b.time;
+            });
+            return entries;
+        }
+
+        /**
+         * @brief 集計結果を表にして書き出す
+         * @param[out] out 出力先
+         */
+        inline void print(std::ostream &out)
+        {
+            out << std::left << std::setw(12) << "combinator" << std::right << std::setw(14) << "calls" << std::setw(14) << "allocations" << std::setw(14) << "time[us]" << '\n';
+            for (const entry &e : report()) {
+                out << std::left << std::setw(12) << e.name << std::right << std::setw(14) << e.calls << std::setw(14) << e.allocations << std::setw(14) << e.time.count() / 1000 << '\n';
+            }
+        }
+
+        /** すべての計数を 0 に戻す */
+        inline void reset()
+        {
+            for (counter *c : counter::registered()) {
+                c->calls = c->allocations = c->nanoseconds = 0;
+            }
+        }
+
+        inline counter Y{"Y"}, I{"I"}, K{"K"}, S{"S"}, i{"i"};
+        inline counter succ{"succ"}, pred{"pred"}, add{"add"}, sub{"sub"}, mult{"mult"}, power{"power"};
+        inline counter is_zero{"is_zero"}, leq{"leq"}, eq{"eq"}, min{"min"}, max{"max"}, quot{"quot"}, rem{"rem"};
+        inline counter cons{"cons"}, car{"car"}, cdr{"cdr"}, is_empty{"is_empty"};
+        inline counter length{"length"}, map{"map"}, foldl{"foldl"}, foldr{"foldr"}, append{"append"}, reverse{"reverse"};
+        inline counter nth{"nth"}, take{"take"}, drop{"drop"}, update{"update"}, filter{"filter"};
+    }
+}
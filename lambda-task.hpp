@@ -0,0 +1,254 @@
+/**
+ * @file lambda-task.hpp
+ * @brief ラムダ計算による評価を途中で中断し、後から再開できるようにします。
+ */
+
+#pragma once
+
+#include "lambda-expression.hpp"
+#include <cerrno>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+namespace lambda {
+    /**
+     * @brief 中断と再開ができる評価
+     * @detail 専用のスタックの上で body を実行し、resume で指定した段数の簡約を行うたびに呼び出し元へ戻る。
+     * 一つのスレッドで多数の評価を少しずつ交互に進められる。
+     * 一度走り出した評価は、最初に resume を呼び出したスレッドでのみ再開すること。
+     * @code
+     * std::vector<unsigned> result;
+     * lambda::task job([&] {
+     *     lambda::run_on_integer_sequence(numbers.begin(), numbers.end(), program, std::back_inserter(result));
+     * });
+     * while (!job.resume(10000)) {
+     *     // ほかの仕事を進める
+     * }
+     * @endcode
+     */
+    class task final : private step_hook {
+    public:
+        /** 中断中の評価を破棄するときに、その評価のスタックを巻き戻すために投げられる */
+        struct cancelled {
+        };
+
+    private:
+        std::function<void()> _body;
+        std::size_t _stack_size;
+        void *_stack = nullptr;
+        ucontext_t _context;
+        ucontext_t _caller;
+        step_hook *_outer = nullptr;
+        std::size_t _steps = 0;
+        std::size_t _budget = 0;
+        bool _started = false;
+        bool _done = false;
+        bool _cancelling = false;
+        bool _waiting = false;
+        std::exception_ptr _error;
+#ifdef LAMBDA_TRACE
+        std::unique_ptr<trace::ring> _trace;
+        trace::ring *_outer_trace = nullptr;
+#endif
+#ifdef LAMBDA_TALLY
+        /** 中断している間の、この評価の中で実行中のコンビネータ。実行している間は呼び出し元のものを預かる */
+        tally::thread_state _tally;
+#endif
+
+        static void trampoline()
+        {
+            task *self = starting();
+            try {
+                self->_body();
+            } catch (const cancelled &) {
+            } catch (...) {
+                self->_error = std::current_exception();
+            }
+            self->_done = true;
+            step_hook::current = self->_outer;
+#ifdef LAMBDA_TRACE
+            trace::current = self->_outer_trace;
+#endif
+            setcontext(&self->_caller);
+        }
+
+        static task *&starting()
+        {
+            static thread_local task *t = nullptr;
+            return t;
+        }
+
+        /** 呼び出し元へ戻る */
+        void suspend()
+        {
+            step_hook::current = _outer;
+#ifdef LAMBDA_TRACE
+            trace::current = _outer_trace;
+#endif
+            swapcontext(&_context, &_caller);
+            step_hook::current = this;
+#ifdef LAMBDA_TRACE
+            trace::current = _trace.get();
+#endif
+            if (_cancelling) {
+                throw cancelled();
+            }
+        }
+
+        void step() override
+        {
+            ++_steps;
+            if (_budget && --_budget == 0) {
+                suspend();
+            }
+        }
+
+        void wait() override
+        {
+            _waiting = true;
+            suspend();
+        }
+
+        void start()
+        {
+            long page = sysconf(_SC_PAGESIZE);
+            _stack_size = (_stack_size + page - 1) / page * page;
+            void *stack = mmap(nullptr, _stack_size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (stack == MAP_FAILED) {
+                throw std::system_error(errno, std::generic_category(), "lambda::task");
+            }
+            /* あふれたときに気付けるよう、末尾の一ページは触れられないようにしておく */
+            mprotect(stack, page, PROT_NONE);
+            _stack = stack;
+            getcontext(&_context);
+            _context.uc_stack.ss_sp = static_cast<char *>(stack) + page;
+            _context.uc_stack.ss_size = _stack_size;
+            _context.uc_link = nullptr;
+            makecontext(&_context, trampoline, 0);
+            starting() = this;
+            _started = true;
+#ifdef LAMBDA_TRACE
+            _trace = std::make_unique<trace::ring>();
+#endif
+        }
+
+    public:
+        /**
+         * @param[in] body 評価する処理
+         * @param[in] stack_size 評価に使うスタックの大きさ。実際に触れた分だけメモリを使う
+         */
+        explicit task(std::function<void()> body, std::size_t stack_size = 8 << 20)
+            : _body(std::move(body)), _stack_size(stack_size)
+        {
+        }
+
+        task(const task &) = delete;
+        task &operator=(const task &) = delete;
+
+        /**
+         * @detail 中断中であれば評価のスタックを巻き戻してから破棄する。
+         */
+        ~task()
+        {
+            cancel();
+            if (_stack) {
+                munmap(_stack, _stack_size + sysconf(_SC_PAGESIZE));
+            }
+        }
+
+        /**
+         * @brief 評価を進める
+         * @param[in] steps 中断するまでに行う簡約の段数の上限。0 なら終わるまで中断しない
+         * @return 評価が終わっていれば true
+         * @detail body が例外を投げて終わったときは、その例外をここで投げ直す。
+         * ほかの評価が使っているサンクの結果を待つ必要が生じたときは、段数に達する前でも中断する。
+         */
+        bool resume(std::size_t steps)
+        {
+            if (_done) {
+                return true;
+            }
+            if (!_started) {
+                start();
+            }
+            _budget = steps;
+            _waiting = false;
+            _outer = step_hook::current;
+            step_hook::current = this;
+#ifdef LAMBDA_TRACE
+            _outer_trace = trace::current;
+            trace::current = _trace.get();
+#endif
+#ifdef LAMBDA_TALLY
+            std::swap(tally::local(), _tally);
+#endif
+            swapcontext(&_caller, &_context);
+#ifdef LAMBDA_TALLY
+            std::swap(tally::local(), _tally);
+#endif
+            step_hook::current = _outer;
+#ifdef LAMBDA_TRACE
+            trace::current = _outer_trace;
+#endif
+            if (_done && _error) {
+                std::rethrow_exception(std::exchange(_error, nullptr));
+            }
+            return _done;
+        }
+
+        /**
+         * @brief 中断中の評価を打ち切る
+         * @detail 評価のスタックを巻き戻し、終わったものとして扱う。評価を始めたスレッドで呼び出すこと。
+         */
+        void cancel()
+        {
+            if (_started && !_done) {
+                _cancelling = true;
+                while (!_done) {
+                    resume(1);
+                }
+            }
+        }
+
+        /** 評価が終わっていれば true */
+        bool done() const
+        {
+            return _done;
+        }
+
+        /** 直前の中断が、ほかの評価が使っているサンクの結果を待つためのものであれば true */
+        bool waiting() const
+        {
+            return _waiting && !_done;
+        }
+
+        /** これまでに行った簡約の段数 */
+        std::size_t steps() const
+        {
+            return _steps;
+        }
+
+        /**
+         * @brief この評価で直近に行われた簡約の記録を得る
+         * @return 古い順に並べた記録。LAMBDA_TRACE を定義していなければ常に空
+         * @detail 打ち切ったあとでも、打ち切る前の記録が残っている。中断中か終わったあとに呼び出すこと。
+         */
+        std::vector<trace::event> trace_events() const
+        {
+#ifdef LAMBDA_TRACE
+            if (_trace) {
+                return _trace->snapshot();
+            }
+#endif
+            return {};
+        }
+    };
+}
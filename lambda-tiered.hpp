@@ -0,0 +1,424 @@
+/**
+ * @file lambda-tiered.hpp
+ * @brief 何度も実行されるプログラムの、入力によらない計算を実行の合間に裏で済ませておきます。
+ * @detail 既定の昇格はプログラムを書き換えず、辿れるサンクを先に評価しておくだけである。
+ * サンクは最初の実行でも評価されて覚えられるので、効くのは昇格より後に初めて必要になる部分に限られる。
+ */
+
+#pragma once
+
+#include "lambda-adt.hpp"
+#include "lambda-checkpoint.hpp"
+#include "lambda-expression.hpp"
+#include "lambda-task.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace lambda {
+    /**
+     * @brief tiered_program の設定
+     */
+    struct tiered_options {
+        /** この回数だけ実行されたら昇格させる */
+        std::size_t invocations = 1000;
+
+        /** 実行に費やした簡約の段数の合計がこれを超えたら昇格させる */
+        std::size_t reductions = 10000000;
+
+        /** speculate が先行評価に使う簡約の段数の上限 */
+        std::size_t budget = 1 << 20;
+
+        /** 昇格に使うスタックの大きさ。実際に触れた分だけメモリを使う */
+        std::size_t stack_size = 8 << 20;
+    };
+
+    namespace tiering {
+        /** 簡約の段数を数え、外側のフックがあればそれにも伝える */
+        class counter final : public step_hook {
+        private:
+            step_hook *_outer;
+
+        public:
+            std::size_t steps = 0;
+
+            counter()
+                : _outer(step_hook::current)
+            {
+                step_hook::current = this;
+            }
+
+            counter(const counter &) = delete;
+            counter &operator=(const counter &) = delete;
+
+            ~counter()
+            {
+                step_hook::current = _outer;
+            }
+
+            void step() override
+            {
+                ++steps;
+                if (_outer) {
+                    _outer->step();
+                }
+            }
+
+            void wait() override
+            {
+                if (_outer) {
+                    _outer->wait();
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        };
+
+        /**
+         * @brief 式から辿れる子を訪れる
+         * @param[in] e 式
+         * @param[in] visit 子の式を受け取る関数
+         * @param[in] arrays 訪れた配列の一覧。同じ配列を二度辿らないために使う
+         */
+        template <class Visitor>
+        inline void each_child(const expression &e, Visitor visit, std::unordered_set<const void *> &arrays)
+        {
+            using access = checkpoint::access;
+            auto array = [&](const std::shared_ptr<const std::vector<expression>> &v) {
+                if (v && arrays.insert(v.get()).second) {
+                    for (const auto &x : *v) {
+                        visit(x);
+                    }
+                }
+            };
+            if (auto t = access::target<access::thunk>(e)) {
+                if (auto v = t->evaluated()) {
+                    visit(*v);
+                }
+            } else if (auto p = access::target<native::pair>(e)) {
+                visit(p->first());
+                visit(p->second());
+            } else if (auto c = access::target<native::constant>(e)) {
+                visit(c->value);
+            } else if (auto s = access::target<native::sum>(e)) {
+                visit(s->terms);
+            } else if (auto v = access::target<native::list>(e)) {
+                array(v->items);
+            } else if (auto q = access::target<native::sequence>(e)) {
+                q->for_each(visit);
+            } else if (auto c = access::target<native::constructor>(e)) {
+                array(c->fields);
+            } else if (auto c = access::target<native::choice>(e)) {
+                visit(c->handler);
+                array(c->fields);
+            } else if (auto c = access::target<native::collector>(e)) {
+                array(c->fields);
+            } else if (auto y = access::target<native::fixpoint>(e)) {
+                visit(y->function);
+            } else if (auto p = access::target<native::partial>(e)) {
+                for (std::size_t i = 0; i < p->count; ++i) {
+                    visit(p->args[i]);
+                }
+            }
+        }
+    }
+
+    namespace tiering {
+        /** 段数の上限に達したことを知らせるために投げる */
+        struct exhausted {
+        };
+
+        /** 簡約の段数を数え、上限に達したら exhausted を投げる */
+        class limit final : public step_hook {
+        private:
+            step_hook *_outer;
+            std::size_t &_used;
+            std::size_t _budget;
+
+        public:
+            limit(std::size_t &used, std::size_t budget)
+                : _outer(step_hook::current), _used(used), _budget(budget)
+            {
+                step_hook::current = this;
+            }
+
+            limit(const limit &) = delete;
+            limit &operator=(const limit &) = delete;
+
+            ~limit()
+            {
+                step_hook::current = _outer;
+            }
+
+            void step() override
+            {
+                if (_used >= _budget) {
+                    throw exhausted();
+                }
+                ++_used;
+                if (_outer) {
+                    _outer->step();
+                }
+            }
+
+            void wait() override
+            {
+                if (_outer) {
+                    _outer->wait();
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        };
+
+        /**
+         * @brief サンクを弱頭部正規形まで評価する
+         * @param[in] x サンク
+         * @param[in,out] used これまでに使った簡約の段数
+         * @param[in] budget 簡約の段数の上限
+         * @return 評価し終えたら true。上限に達したり例外が投げられたりしたら評価を打ち切って false
+         * @detail 打ち切ったサンクは、評価の途中で投げられた例外と同じく未評価に戻る。
+         * 深い評価でスタックを溢れさせないよう、十分な大きさのスタックの上で呼び出すこと。
+         */
+        inline bool evaluate(const expression &x, std::size_t &used, std::size_t budget)
+        {
+            if (used >= budget) {
+                return false;
+            }
+            limit guard(used, budget);
+            try {
+                whnf(x);
+                return true;
+            } catch (const task::cancelled &) {
+                throw;
+            } catch (...) {
+                return false;
+            }
+        }
+
+        /**
+         * @brief 式から辿れるサンクを評価していく
+         * @param[in] queue 辿り始める式の一覧
+         * @param[in] budget 評価に使う簡約の段数の上限
+         * @param[in] evaluating false なら何も評価せず、辿れた未評価のサンクを集めるだけにする
+         * @return evaluating が false のとき、辿れた未評価のサンクの一覧
+         * @detail 未評価の適用は、評価すると関数の中に隠れてしまう関数と引数を先に辿り、そのあとで評価する。
+         * 辿る式の数も段数と同じ上限で抑える。evaluating が true のときは evaluate と同じく十分なスタックの上で呼び出すこと。
+         */
+        inline std::vector<expression> traverse(std::vector<expression> queue, std::size_t budget, bool evaluating)
+        {
+            using access = checkpoint::access;
+            std::vector<expression> pending;
+            std::unordered_set<const void *> expanded;
+            std::unordered_set<const void *> seen;
+            std::unordered_set<const void *> arrays;
+            std::size_t used = 0;
+            for (std::size_t i = 0; i < queue.size() && i < budget && used < budget; ++i) {
+                expression x = queue[i];
+                if (auto t = access::target<access::thunk>(x)) {
+                    if (!t->evaluated()) {
+                        if (expanded.insert(access::identity(*t)).second) {
+                            if (auto [function, argument] = access::application(*t); function) {
+                                queue.push_back(*function);
+                                queue.push_back(*argument);
+                            }
+                            if (evaluating) {
+                                queue.push_back(x);
+                            } else {
+                                pending.push_back(x);
+                            }
+                            continue;
+                        }
+                        if (!evaluate(x, used, budget)) {
+                            continue;
+                        }
+                    }
+                    if (!seen.insert(access::identity(*t)).second) {
+                        continue;
+                    }
+                } else if (auto p = access::target<native::pair>(x)) {
+                    if (!seen.insert(&p->first()).second) {
+                        continue;
+                    }
+                }
+                each_child(x, [&queue](const expression &c) { queue.push_back(c); }, arrays);
+            }
+            return pending;
+        }
+    }
+
+    /**
+     * @brief プログラムから辿れる、入力によらない計算を先に済ませておく
+     * @param[in] program プログラム
+     * @param[in] budget 先行評価に使う簡約の段数の上限
+     * @param[in] stack_size 先行評価に使うスタックの大きさ
+     * @return program そのもの。辿れたサンクは評価済みになっている
+     * @detail program から、未評価の適用の関数と引数やネイティブ表現を介して辿れるサンクを、
+     * 引数を先にして幅優先で一つずつ評価する。サンクは入力を受け取る前から存在するので、その値は入力によらない。
+     * 一つのサンクの評価が残りの段数を使い切ったり例外を投げたりしたときは、その評価を打ち切ってサンクを未評価に戻す。
+     * 評価済みの適用の関数と引数や、クロージャが捕捉した値の中は見えないので辿らない。
+     * ほかのスレッドが同じプログラムを実行している最中に呼び出してよい。
+     * 先行評価はすべて一つの task の上で行う。
+     */
+    inline expression speculate(const expression &program, std::size_t budget, std::size_t stack_size = tiered_options().stack_size)
+    {
+        task job([&program, budget] { tiering::traverse({program}, budget, true); }, stack_size);
+        while (!job.resume(0)) {
+            /* ほかのスレッドが評価しているサンクを待っている */
+            std::this_thread::yield();
+        }
+        return program;
+    }
+
+    /**
+     * @brief 実行の回数と簡約の段数を数え、よく使われるようになったら昇格させるプログラム
+     * @detail 最初はそのまま実行し、options.invocations 回実行されるか、費やした簡約の段数の合計が
+     * options.reductions を超えたら、裏のスレッドで promote を呼び出して昇格させる。
+     * 昇格は一つの task の上で行う。昇格が終わるまでの実行と、昇格の時点で走っている実行は元のプログラムのまま続く。
+     * 既定の promote はプログラムを書き換えず、入力によらない計算を先に評価しておくだけである。
+     * 昇格したあとは段数を数えない。
+     * @code
+     * lambda::tiered_program program(build_program());
+     * for (const auto &input : requests) {
+     *     program.run(input.begin(), input.end(), std::back_inserter(result));
+     * }
+     * @endcode
+     */
+    class tiered_program final {
+    public:
+        /** 昇格に使う関数。元のプログラムを受け取り、同じ結果を返す式を返す */
+        using promoter = std::function<expression(const expression &)>;
+
+    private:
+        tiered_options _options;
+        promoter _promote;
+        mutable std::mutex _mutex;
+        expression _program;
+        std::atomic<int> _tier = 0;
+        std::atomic<bool> _promoting = false;
+        std::atomic<std::size_t> _invocations = 0;
+        std::atomic<std::size_t> _reductions = 0;
+        std::mutex _promoter_mutex;
+        std::thread _promoter;
+
+        /** 昇格させるべきであれば裏のスレッドで昇格を始める */
+        void consider()
+        {
+            if (_invocations.load(std::memory_order_relaxed) < _options.invocations && _reductions.load(std::memory_order_relaxed) < _options.reductions) {
+                return;
+            }
+            if (_promoting.exchange(true)) {
+                return;
+            }
+            expression cold = current();
+            std::lock_guard<std::mutex> lock(_promoter_mutex);
+            _promoter = std::thread([this, cold] {
+                /* 昇格全体を一つの task で行い、呼び出し元のスタックの大きさによらないようにする */
+                expression hot;
+                task job([this, &cold, &hot] { hot = _promote(cold); }, _options.stack_size);
+                try {
+                    while (!job.resume(0)) {
+                        std::this_thread::yield();
+                    }
+                } catch (...) {
+                    /* 昇格に失敗したら元のまま使い続ける */
+                    return;
+                }
+                std::lock_guard<std::mutex> lock(_mutex);
+                _program = std::move(hot);
+                _tier = 1;
+            });
+        }
+
+    public:
+        /**
+         * @param[in] program プログラム
+         * @param[in] options 設定
+         * @param[in] promote 昇格に使う関数。省略すると、作った時点で program から辿れたサンクを speculate と同じ要領で評価しておく
+         */
+        explicit tiered_program(expression program, tiered_options options = tiered_options(), promoter promote = nullptr)
+            : _options(options), _promote(std::move(promote)), _program(std::move(program))
+        {
+            if (!_promote) {
+                /* 一度実行すると適用の関数と引数は見えなくなるので、先行評価の候補は今のうちに集めておく */
+                auto pending = std::make_shared<std::vector<expression>>(tiering::traverse({_program}, options.budget, false));
+                _promote = [pending, options](const expression &p) {
+                    tiering::traverse(std::move(*pending), options.budget, true);
+                    return p;
+                };
+            }
+        }
+
+        tiered_program(const tiered_program &) = delete;
+        tiered_program &operator=(const tiered_program &) = delete;
+
+        /** 昇格の途中であれば終わるのを待ってから破棄する */
+        ~tiered_program()
+        {
+            wait();
+        }
+
+        /** 現在のプログラム */
+        expression current() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _program;
+        }
+
+        /** 現在の段階。0 なら元のまま、1 なら昇格済み */
+        int tier() const
+        {
+            return _tier.load(std::memory_order_acquire);
+        }
+
+        /** これまでに実行された回数 */
+        std::size_t invocations() const
+        {
+            return _invocations.load(std::memory_order_relaxed);
+        }
+
+        /** 昇格するまでに実行に費やした簡約の段数の合計 */
+        std::size_t reductions() const
+        {
+            return _reductions.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief 自然数の列に対しプログラムを実行する
+         * @param[in] first 先頭要素を指すイテレータ
+         * @param[in] last 最後の要素の次を指すイテレータ
+         * @param[out] result 結果の自然数のリストの出力先
+         * @detail run_on_integer_sequence と同じ処理を行う。複数のスレッドから同時に呼び出してよい。
+         * task の中で呼び出したときは、中断をまたいだあとの段数は数えない。
+         */
+        template <class InputIterator, class OutputIterator>
+        void run(InputIterator first, InputIterator last, OutputIterator result)
+        {
+            _invocations.fetch_add(1, std::memory_order_relaxed);
+            expression program = current();
+            if (tier() == 0) {
+                tiering::counter counting;
+                run_on_integer_sequence(first, last, program, result);
+                _reductions.fetch_add(counting.steps, std::memory_order_relaxed);
+                consider();
+            } else {
+                run_on_integer_sequence(first, last, program, result);
+            }
+        }
+
+        /** 昇格が始まっていれば終わるまで待つ */
+        void wait()
+        {
+            std::lock_guard<std::mutex> lock(_promoter_mutex);
+            if (_promoter.joinable()) {
+                _promoter.join();
+            }
+        }
+    };
+}
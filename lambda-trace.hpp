@@ -0,0 +1,172 @@
+/**
+ * @file lambda-trace.hpp
+ * @brief 直近の簡約の記録をスレッドごとのリングバッファに残し、後から調べられるようにします。
+ * @detail LAMBDA_TRACE を定義してコンパイルしたときだけ記録する。記録はロックを取らず、
+ * 一件あたり数回の書き込みで済むので、常に有効にしておける。
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <typeinfo>
+#include <vector>
+#include <cxxabi.h>
+
+#ifndef LAMBDA_TRACE_SIZE
+/** リングバッファに残す記録の数。2 のべき乗であること */
+#define LAMBDA_TRACE_SIZE 1024
+#endif
+
+namespace lambda {
+    namespace trace {
+        /** 記録の種類 */
+        enum class kind : std::uint8_t {
+            apply,    /**< 関数適用を一段行った。type は適用した関数 */
+            allocate, /**< サンクを確保した。size はその大きさ */
+            force,    /**< サンクの評価を始めた。type はその関数 */
+            wait      /**< ほかで評価中のサンクの結果を待った */
+        };
+
+        /** 一件の記録 */
+        struct event {
+            /** 関わった関数の実装の型。なければ nullptr */
+            const std::type_info *type;
+
+            /** サンクの評価の入れ子の深さ */
+            std::uint32_t depth;
+
+            /** 確保した大きさ (バイト) */
+            std::uint32_t size;
+
+            kind what;
+        };
+
+        /**
+         * @brief 実装の型を読める名前にする
+         * @param[in] type 実装の型
+         * @return ネイティブ表現や組み込みのコンビネータであればその名前、そうでなければデマングルした型名
+         */
+        std::string describe(const std::type_info &type);
+
+        /**
+         * @brief 直近の記録を決まった数だけ残すリングバッファ
+         * @detail 書き込むのは持ち主のスレッドだけで、古い記録は上書きされる。
+         * ほかのスレッドから読むと書き込み途中の記録が混ざることがある。
+         */
+        class ring final {
+        private:
+            static_assert((LAMBDA_TRACE_SIZE & (LAMBDA_TRACE_SIZE - 1)) == 0, "LAMBDA_TRACE_SIZE must be a power of two");
+            std::array<event, LAMBDA_TRACE_SIZE> _events{};
+            std::uint64_t _position = 0;
+
+        public:
+            /** 現在のサンクの評価の入れ子の深さ */
+            std::uint32_t depth = 0;
+
+            void record(kind what, const std::type_info *type, std::uint32_t size = 0)
+            {
+                _events[_position++ & (LAMBDA_TRACE_SIZE - 1)] = {type, depth, size, what};
+            }
+
+            /** これまでに記録した件数。上書きされたものも含む */
+            std::uint64_t recorded() const
+            {
+                return _position;
+            }
+
+            /**
+             * @brief 残っている記録を古い順に取り出す
+             * @return 記録の一覧
+             */
+            std::vector<event> snapshot() const
+            {
+                std::uint64_t last = _position;
+                std::uint64_t first = last > LAMBDA_TRACE_SIZE ? last - LAMBDA_TRACE_SIZE : 0;
+                std::vector<event> events;
+                events.reserve(last - first);
+                for (std::uint64_t i = first; i < last; ++i) {
+                    events.push_back(_events[i & (LAMBDA_TRACE_SIZE - 1)]);
+                }
+                return events;
+            }
+
+            void clear()
+            {
+                _position = 0;
+                depth = 0;
+            }
+        };
+
+        /** 現在のスレッドで記録先になっているリング。nullptr ならスレッドのリングに記録する */
+        inline thread_local ring *current = nullptr;
+
+        /** 現在のスレッドのリング */
+        inline ring &this_thread()
+        {
+            thread_local ring r;
+            return r;
+        }
+
+        /** 現在の記録先 */
+        inline ring &target()
+        {
+            ring *r = current;
+            return r ? *r : this_thread();
+        }
+
+        /** サンクの評価の間だけ入れ子の深さを一つ増やす */
+        class nested final {
+        private:
+            ring &_ring;
+
+        public:
+            nested()
+                : _ring(target())
+            {
+                ++_ring.depth;
+            }
+
+            nested(const nested &) = delete;
+            nested &operator=(const nested &) = delete;
+
+            ~nested()
+            {
+                --_ring.depth;
+            }
+        };
+
+        /**
+         * @brief 記録を一行ずつ書き出す
+         * @param[out] out 出力先
+         * @param[in] events 記録の一覧
+         * @detail 一行に「種類 深さ 関数 大きさ」を空白区切りで書き出す。
+         */
+        inline void dump(std::ostream &out, const std::vector<event> &events)
+        {
+            static const char *const names[] = {"apply", "allocate", "force", "wait"};
+            for (const event &e : events) {
+                out << names[static_cast<int>(e.what)] << ' ' << e.depth << ' ' << (e.type ? describe(*e.type) : std::string("-"));
+                if (e.what == kind::allocate) {
+                    out << ' ' << e.size;
+                }
+                out << '\n';
+            }
+        }
+
+        /** 型名をデマングルする */
+        inline std::string demangle(const std::type_info &type)
+        {
+            int status = 0;
+            std::unique_ptr<char, void (*)(void *)> name(abi::__cxa_demangle(type.name(), nullptr, nullptr, &status), std::free);
+            return status == 0 && name ? std::string(name.get()) : std::string(type.name());
+        }
+    }
+}
+
+#include "lambda-expression.hpp"
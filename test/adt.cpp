@@ -0,0 +1,68 @@
+/**
+ * @file adt.cpp
+ * @brief 代数的データ型のエンコードとデコードを確かめます。
+ */
+
+#undef NDEBUG
+#include "lambda-adt.hpp"
+#include <cassert>
+#include <memory>
+#include <tuple>
+#include <variant>
+
+using namespace lambda;
+
+namespace {
+    /** 深さがそのまま長さになる木 */
+    struct chain;
+    using link = std::tuple<unsigned, std::shared_ptr<chain>>;
+    struct chain {
+        std::variant<std::monostate, link> v;
+    };
+
+    /** C++ の側の木も再帰せずに解放する */
+    void dismantle(std::shared_ptr<chain> c)
+    {
+        while (c && c.use_count() == 1 && c->v.index() == 1) {
+            std::shared_ptr<chain> next = std::move(std::get<1>(std::get<1>(c->v)));
+            c = std::move(next);
+        }
+    }
+}
+
+template <>
+struct lambda::adt::representation<chain> {
+    using type = std::variant<std::monostate, link>;
+    static type represent(const chain &c)
+    {
+        return c.v;
+    }
+    static chain restore(type &&v)
+    {
+        return {std::move(v)};
+    }
+};
+
+int main()
+{
+    const unsigned depth = 200000;
+    auto root = std::make_shared<chain>();
+    for (unsigned i = 0; i < depth; ++i) {
+        root = std::make_shared<chain>(chain{link{i, std::move(root)}});
+    }
+
+    {
+        /* デコードでエンコードを最後まで強制したあと、ラムダ式の側の深い木を解放する */
+        expression e = adt_encode(root);
+        auto decoded = adt_decode<std::shared_ptr<chain>>(e);
+        unsigned n = 0, expected = depth;
+        for (const chain *c = decoded.get(); c->v.index() == 1; c = std::get<1>(std::get<1>(c->v)).get()) {
+            assert(std::get<0>(std::get<1>(c->v)) == --expected);
+            ++n;
+        }
+        assert(n == depth);
+        dismantle(std::move(decoded));
+        dismantle(std::move(root));
+    }
+    return 0;
+}
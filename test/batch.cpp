@@ -0,0 +1,31 @@
+/**
+ * @file batch.cpp
+ * @brief リングバッファより多くの結果を出す区間が並んでも、入力の順に正しく受け取れることを確かめます。
+ */
+
+#undef NDEBUG
+#include "lambda-batch.hpp"
+#include <cassert>
+#include <vector>
+
+using namespace lambda;
+using namespace lambda::combinators;
+
+int main()
+{
+    std::vector<std::vector<std::size_t>> inputs;
+    for (std::size_t i = 0; i < 64; ++i) {
+        inputs.emplace_back(200, i);
+    }
+    batch_options options;
+    options.workers = 4;
+    options.ring_size = 256;
+    std::size_t next = 0;
+    run_on_batch(inputs, map(succ), [&](std::size_t i, const std::vector<std::size_t> &result) {
+        /* 後ろの区間が先に溜めた結果も、前の区間を待ってから順に渡される */
+        assert(i == next++);
+        assert(result == std::vector<std::size_t>(200, i + 1));
+    }, options);
+    assert(next == inputs.size());
+    return 0;
+}
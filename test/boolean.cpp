@@ -0,0 +1,23 @@
+/**
+ * @file boolean.cpp
+ * @brief チャーチブール値の分岐を確かめます。
+ */
+
+#undef NDEBUG
+#include "lambda-checkpoint.hpp"
+#include <cassert>
+
+using namespace lambda;
+using namespace lambda::combinators;
+
+int main()
+{
+    expression a = church_encode(1), b = church_encode(2);
+    assert(church_decode(truth(a)(b)) == 1);
+    assert(church_decode(falsity(a)(b)) == 2);
+
+    /* 偽の分岐はクロージャを作らず、組み込みの I を返す */
+    expression branch = falsity(a);
+    assert(trace::describe(checkpoint::access::type(whnf(branch))) == "I");
+    return 0;
+}
@@ -0,0 +1,58 @@
+/**
+ * @file checkpoint.cpp
+ * @brief コンストラクタの番号が範囲外のチェックポイントを、読み戻すときに壊れたものとして退けることを確かめます。
+ */
+
+#undef NDEBUG
+#include "lambda-checkpoint.hpp"
+#include <cassert>
+#include <stdexcept>
+#include <string>
+
+using namespace lambda;
+using namespace lambda::combinators;
+
+namespace {
+    /** 見出しと節の数を付けてチェックポイントのバイト列にする。最後の節が根になる */
+    std::string image(std::size_t slots, const std::string &nodes)
+    {
+        return std::string("LMCK") + char(checkpoint::version) + char(slots) + nodes + char(slots);
+    }
+
+    std::string node(checkpoint::tag t)
+    {
+        return std::string(1, static_cast<char>(t));
+    }
+
+    bool corrupt(const std::string &data)
+    {
+        try {
+            checkpoint_decode(data);
+        } catch (const std::runtime_error &) {
+            return true;
+        }
+        return false;
+    }
+}
+
+int main()
+{
+    using checkpoint::tag;
+    {
+        /* 範囲内の番号は読み戻せる */
+        expression e = checkpoint_decode(image(1, node(tag::constructor) + '\1' + '\2' + '\0'));
+        assert(church_decode(e(church_encode(1))(church_encode(2))) == 2);
+        assert(!corrupt(image(2, node(tag::numeral) + '\0' + node(tag::choice) + '\0' + '\1' + '\2' + '\1' + '\0')));
+    }
+    {
+        /* 何番目かがコンストラクタの数以上なら壊れている */
+        assert(corrupt(image(1, node(tag::constructor) + '\2' + '\2' + '\0')));
+        assert(corrupt(image(1, node(tag::collector) + '\3' + '\2' + '\1' + '\0')));
+        assert(corrupt(image(2, node(tag::numeral) + '\0' + node(tag::choice) + '\2' + '\1' + '\2' + '\1' + '\0')));
+    }
+    {
+        /* 受け取った数がコンストラクタの数を超えていても壊れている */
+        assert(corrupt(image(2, node(tag::numeral) + '\0' + node(tag::choice) + '\0' + '\3' + '\2' + '\1' + '\0')));
+    }
+    return 0;
+}
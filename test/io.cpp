@@ -0,0 +1,67 @@
+/**
+ * @file io.cpp
+ * @brief 整数のファイルに対する実行を確かめます。
+ */
+
+#undef NDEBUG
+#include "lambda-io.hpp"
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace lambda;
+using namespace lambda::combinators;
+
+namespace {
+    std::vector<std::uint32_t> load(const std::string &path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::vector<std::uint32_t> values;
+        std::uint32_t v;
+        while (in.read(reinterpret_cast<char *>(&v), sizeof(v))) {
+            values.push_back(v);
+        }
+        return values;
+    }
+}
+
+int main()
+{
+    const std::string input = "/tmp/lambda-io-test-" + std::to_string(::getpid()) + ".in";
+    const std::string output = "/tmp/lambda-io-test-" + std::to_string(::getpid()) + ".out";
+    std::vector<std::uint32_t> values;
+    for (std::uint32_t i = 0; i < 100000; ++i) {
+        values.push_back(i);
+    }
+    {
+        std::ofstream out(input, std::ios::binary);
+        out.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(std::uint32_t));
+    }
+
+    run_on_integer_file<std::uint32_t>(input.c_str(), map(succ), output.c_str());
+    std::vector<std::uint32_t> result = load(output);
+    assert(result.size() == values.size());
+    for (std::size_t i = 0; i < values.size(); ++i) {
+        assert(result[i] == values[i] + 1);
+    }
+
+    /* 入力と同じファイルへは書き出さず、入力もそのまま残す */
+    const std::string alias = "/tmp/./lambda-io-test-" + std::to_string(::getpid()) + ".in";
+    bool thrown = false;
+    try {
+        run_on_integer_file<std::uint32_t>(input.c_str(), map(succ), alias.c_str());
+    } catch (const std::invalid_argument &) {
+        thrown = true;
+    }
+    assert(thrown);
+    assert(load(input) == values);
+
+    std::remove(input.c_str());
+    std::remove(output.c_str());
+    return 0;
+}
@@ -0,0 +1,46 @@
+/**
+ * @file list.cpp
+ * @brief スコットリストのライブラリが純粋な定義と同じだけしか評価しないことを確かめます。
+ */
+
+#undef NDEBUG
+#include "lambda-expression.hpp"
+#include <cassert>
+#include <vector>
+
+using namespace lambda;
+using namespace lambda::combinators;
+
+namespace {
+    std::vector<std::size_t> decode(expression l)
+    {
+        std::vector<expression> items;
+        scott_decode(std::move(l), std::back_inserter(items));
+        std::vector<std::size_t> result;
+        for (const auto &x : items) {
+            result.push_back(church_decode(x));
+        }
+        return result;
+    }
+
+    /** 先頭の後ろに、自分自身の各要素に 1 を足したものを続けたリスト */
+    expression knot(expression prefix)
+    {
+        return Y([prefix](expression xs) { return append(prefix)(map(succ)(xs)); });
+    }
+}
+
+int main()
+{
+    const std::vector<std::size_t> expected = {1, 2, 2, 3, 3};
+    const std::vector<expression> prefix = {church_encode(1), church_encode(2)};
+
+    /* append は後ろのリストを評価せずにセルを返すので、自分自身を後ろにつなげられる */
+    assert(decode(take(church_encode(5))(knot(scott_encode(prefix.begin(), prefix.end())))) == expected);
+    assert(decode(take(church_encode(5))(knot(cons(prefix[0])(cons(prefix[1])(empty_list))))) == expected);
+
+    /* 評価済みの配列どうしは一つの配列にまとめる */
+    expression joined = append(scott_encode(prefix.begin(), prefix.end()))(scott_encode(prefix.begin(), prefix.end()));
+    assert(decode(joined) == (std::vector<std::size_t>{1, 2, 1, 2}));
+    return 0;
+}
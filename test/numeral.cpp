@@ -0,0 +1,61 @@
+/**
+ * @file numeral.cpp
+ * @brief 数の近道が純粋な定義より多くを評価しないことを確かめます。
+ */
+
+#undef NDEBUG
+#include "lambda-expression.hpp"
+#include <cassert>
+#include <stdexcept>
+
+using namespace lambda;
+using namespace lambda::combinators;
+
+namespace {
+    /** 真なら 1、偽なら 0 */
+    std::size_t decode(expression b)
+    {
+        return church_decode(b(church_encode(1))(church_encode(0)));
+    }
+
+    /** x を返す未評価の適用 */
+    expression delay(expression x)
+    {
+        return expression([x](expression) { return x; })(I);
+    }
+}
+
+int main()
+{
+    /* 評価すると例外を投げる式 */
+    expression omega = expression([](expression) -> expression { throw std::logic_error("forced"); })(I);
+    expression three = church_encode(3), zero = church_encode(0);
+
+    assert(decode(is_zero(succ(omega))) == 0);
+    assert(decode(is_zero(add(three)(omega))) == 0);
+    assert(church_decode(quot(omega)(zero)) == 0);
+    assert(church_decode(mult(zero)(omega)) == 0);
+
+    /* 評価していない数を足したものも、純粋な定義と同じだけしか評価しない */
+    expression pure_is_zero = [](expression n) { return n(K(falsity))(truth); };
+    assert(decode(pure_is_zero(add(three)(omega))) == 0);
+    assert(decode(pure_is_zero(succ(succ(omega)))) == 0);
+    assert(decode(is_zero(add(add(three)(omega))(omega))) == 0);
+
+    /* 後回しにした数は値が必要になったときに足される */
+    expression lazy = add(church_encode(2))(delay(three));
+    assert(church_decode(lazy) == 5);
+    assert(church_decode(succ(add(lazy)(delay(lazy)))) == 11);
+    assert(church_decode(mult(lazy)(three)) == 15);
+
+    /* 評価済みのネイティブな数どうしは近道する */
+    assert(church_decode(add(three)(church_encode(4))) == 7);
+    assert(church_decode(sub(church_encode(4))(three)) == 1);
+    assert(decode(leq(three)(church_encode(4))) == 1);
+    assert(decode(eq(three)(three)) == 1);
+    assert(church_decode(min(three)(church_encode(4))) == 3);
+    assert(church_decode(max(three)(church_encode(4))) == 4);
+    assert(church_decode(quot(church_encode(7))(three)) == 2);
+    assert(church_decode(rem(church_encode(7))(three)) == 1);
+    return 0;
+}
@@ -0,0 +1,69 @@
+/**
+ * @file scheduler.cpp
+ * @brief 同じワーカーの仕事どうしがサンクを共有しても、スケジューラが止まらないことを確かめます。
+ */
+
+#undef NDEBUG
+#include "lambda-scheduler.hpp"
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <thread>
+
+using namespace lambda;
+using namespace lambda::combinators;
+
+namespace {
+    /** 0 から n - 1 までの和を、ネイティブのループに頼らずに求める式 */
+    expression slow_sum(std::size_t n)
+    {
+        expression loop = Y([](expression self) {
+            return [self](expression acc) {
+                return [self, acc](expression k) {
+                    return is_zero(k)(acc)(self(add(acc)(pred(k)))(pred(k)));
+                };
+            };
+        });
+        return loop(church_encode(0))(church_encode(n));
+    }
+
+    /**
+     * @brief 先に走り出した仕事が評価しているサンクを、後から投入した仕事が待つ
+     * @param[in] same_tenant false なら後の仕事を別のテナントにする
+     * @param[in] priority 後の仕事の優先度
+     */
+    void share(bool same_tenant, int priority)
+    {
+        const std::size_t n = 3000;
+        scheduler s(1, 100);
+        expression shared = slow_sum(n);
+        std::atomic<bool> started = false;
+        std::size_t first = 0, second = 0;
+
+        auto a = s.submit("a", [&] {
+            started = true;
+            first = church_decode(shared);
+        });
+        while (!started) {
+            std::this_thread::yield();
+        }
+        auto b = s.submit(same_tenant ? "a" : "b", [&] { second = church_decode(shared); }, priority);
+
+        assert(b.finished.wait_for(std::chrono::seconds(60)) == std::future_status::ready);
+        assert(a.finished.wait_for(std::chrono::seconds(60)) == std::future_status::ready);
+        b.finished.get();
+        a.finished.get();
+        assert(first == n * (n - 1) / 2);
+        assert(second == first);
+    }
+}
+
+int main()
+{
+    /* 待つ仕事のほうが優先度が高い */
+    share(true, 1);
+
+    /* 待つ仕事のテナントのほうが段数を使っていない */
+    share(false, 0);
+    return 0;
+}
@@ -0,0 +1,58 @@
+/**
+ * @file sequence.cpp
+ * @brief 平衡二分木に格納したリストの append を確かめます。
+ */
+
+#undef NDEBUG
+#include "lambda-expression.hpp"
+#include <cassert>
+#include <vector>
+
+using namespace lambda;
+using namespace lambda::combinators;
+
+namespace {
+    std::vector<std::size_t> decode(expression l)
+    {
+        std::vector<expression> items;
+        scott_decode(std::move(l), std::back_inserter(items));
+        std::vector<std::size_t> result;
+        for (const auto &x : items) {
+            result.push_back(church_decode(x));
+        }
+        return result;
+    }
+
+    expression encode(std::size_t n, bool tree)
+    {
+        std::vector<expression> items;
+        for (std::size_t i = 0; i < n; ++i) {
+            items.push_back(church_encode(i));
+        }
+        return tree ? sequence_encode(items.begin(), items.end()) : scott_encode(items.begin(), items.end());
+    }
+}
+
+int main()
+{
+    const std::vector<std::size_t> three = {0, 1, 2}, none;
+
+    /* 空のリストをつなげても元のまま */
+    assert(decode(append(encode(3, true))(empty_list)) == three);
+    assert(decode(append(encode(3, true))(encode(0, false))) == three);
+    assert(decode(append(empty_list)(encode(3, true))) == three);
+    assert(decode(append(encode(0, true))(empty_list)) == none);
+
+    /* 種類の違うリストどうしをつなげる */
+    const std::vector<std::size_t> six = {0, 1, 2, 0, 1, 2};
+    assert(decode(append(encode(3, true))(encode(3, false))) == six);
+    assert(decode(append(encode(3, false))(encode(3, true))) == six);
+    assert(decode(append(encode(3, true))(encode(3, true))) == six);
+    assert(decode(append(encode(3, true))(cons(church_encode(0))(cons(church_encode(1))(cons(church_encode(2))(empty_list))))) == six);
+
+    /* 後ろのリストを評価せずにセルを返すので、自分自身を後ろにつなげられる */
+    expression prefix = encode(2, true);
+    expression knot = Y([prefix](expression xs) { return append(prefix)(map(succ)(xs)); });
+    assert(decode(take(church_encode(5))(knot)) == (std::vector<std::size_t>{0, 1, 1, 2, 2}));
+    return 0;
+}
@@ -0,0 +1,60 @@
+/**
+ * @file server.cpp
+ * @brief サーバを止めたあとで再び受け付けを始められることを確かめます。
+ */
+
+#undef NDEBUG
+#include "lambda-server.hpp"
+#include <cassert>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+using namespace lambda;
+using namespace lambda::combinators;
+
+int main()
+{
+    const std::string path = "/tmp/lambda-test-server-" + std::to_string(::getpid()) + ".sock";
+    server s(2);
+    s.add("double", map(mult(church_encode(2))));
+    s.add("succ", map(succ));
+    const std::vector<std::size_t> input = {1, 2, 3};
+
+    for (int round = 0; round < 3; ++round) {
+        s.start(path);
+        {
+            client c(path);
+            assert((c.evaluate("double", input) == std::vector<std::size_t>{2, 4, 6}));
+            assert((c.evaluate("succ", input) == std::vector<std::size_t>{2, 3, 4}));
+            bool rejected = false;
+            try {
+                c.evaluate("missing", input);
+            } catch (const std::invalid_argument &) {
+                rejected = true;
+            }
+            assert(rejected);
+        }
+        s.stop();
+    }
+
+    /* 同じプログラムへの要求を並行して送っても、どれも応答される */
+    s.start(path);
+    std::vector<std::thread> clients;
+    std::vector<int> answered(8, 0);
+    for (std::size_t i = 0; i < answered.size(); ++i) {
+        clients.emplace_back([&, i] {
+            client c(path);
+            answered[i] = c.evaluate("double", input) == std::vector<std::size_t>{2, 4, 6};
+        });
+    }
+    for (auto &t : clients) {
+        t.join();
+    }
+    s.stop();
+    for (int ok : answered) {
+        assert(ok);
+    }
+    return 0;
+}
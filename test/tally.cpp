@@ -0,0 +1,58 @@
+/**
+ * @file tally.cpp
+ * @brief 同じスレッドで交互に進む評価どうしで、確保したサンクの数が混ざらないことを確かめます。
+ */
+
+#undef NDEBUG
+#define LAMBDA_TALLY
+#include "lambda-task.hpp"
+#include <cassert>
+#include <vector>
+
+using namespace lambda;
+using namespace lambda::combinators;
+
+namespace {
+    std::uint64_t allocations(const tally::counter &c)
+    {
+        return c.allocations.load();
+    }
+}
+
+int main()
+{
+    std::vector<expression> items;
+    for (std::size_t i = 0; i < 1000; ++i) {
+        items.push_back(church_encode(i));
+    }
+    expression list = scott_encode(items.begin(), items.end());
+    expression step = [](expression acc) {
+        return [acc](expression x) {
+            return add(acc)(x);
+        };
+    };
+
+    tally::reset();
+    std::size_t sum = 0;
+    task folding([&] { sum = church_decode(foldl(step)(church_encode(0))(list)); });
+
+    /* foldl の本体の中で中断させる */
+    assert(!folding.resume(50));
+    std::uint64_t before = allocations(tally::foldl);
+
+    /* 中断中に、どのコンビネータの外でもサンクを確保する */
+    expression identity = [](expression x) {
+        return x;
+    };
+    std::vector<expression> thunks;
+    for (int i = 0; i < 100; ++i) {
+        thunks.push_back(identity(church_encode(i)));
+    }
+    assert(allocations(tally::foldl) == before);
+
+    while (!folding.resume(50)) {
+    }
+    assert(sum == 999 * 1000 / 2);
+    assert(tally::local().innermost == nullptr);
+    return 0;
+}
@@ -0,0 +1,52 @@
+/**
+ * @file tiered.cpp
+ * @brief 昇格と先行評価が既定のスタックの大きさで済むことを確かめます。
+ */
+
+#undef NDEBUG
+#include "lambda-tiered.hpp"
+#include <cassert>
+#include <iterator>
+#include <vector>
+
+using namespace lambda;
+using namespace lambda::combinators;
+
+namespace {
+    /** 長い遅延リストを作って畳み込み、その中間のリストを捨てる計算 */
+    expression slow()
+    {
+        return foldl(add)(church_encode(0))(map(succ)(nth(church_encode(0))(cons(take(church_encode(200000))(Y(cons(church_encode(1)))))(empty_list))));
+    }
+
+    std::vector<unsigned> run(tiered_program &p)
+    {
+        std::vector<unsigned> in{1}, out;
+        p.run(in.begin(), in.end(), std::back_inserter(out));
+        return out;
+    }
+}
+
+int main()
+{
+    {
+        /* 昇格は一つの task の上で行われ、長いリストの評価と解放でスタックを溢れさせない */
+        tiered_options options;
+        options.invocations = 2;
+        tiered_program p(K(cons(slow())(empty_list)), options);
+        for (int i = 0; i < 4; ++i) {
+            assert(run(p) == std::vector<unsigned>{400000});
+            p.wait();
+        }
+        assert(p.tier() == 1);
+    }
+    {
+        /* 段数の上限で打ち切った先行評価は結果を変えない */
+        expression program = K(cons(slow())(empty_list));
+        speculate(program, 1000);
+        std::vector<unsigned> in{1}, out;
+        run_on_integer_sequence(in.begin(), in.end(), program, std::back_inserter(out));
+        assert(out == std::vector<unsigned>{400000});
+    }
+    return 0;
+}